@@ -1,29 +1,145 @@
 #include "kernel.hh"
 #include "k-lock.hh"
 
+// k-alloc.cc
+//
+//    Physical page allocator. Every allocatable page has a reference
+//    count; `kallocpage()` returns a page with count 1, `kincref()`
+//    adds a reference (for instance, when a copy-on-write mapping is
+//    shared), and `kfree()` drops one, returning the page to the free
+//    list when the count reaches zero. Pages outside `mem_available`
+//    memory, such as kernel image pages, are not reference counted.
+
 static spinlock page_lock;
 static uintptr_t next_free_pa;
+static x86_64_page* free_list;      // freed pages, linked through word 0
+
+#define NPAGES (MEMSIZE_PHYSICAL / PAGESIZE)
+static std::atomic<unsigned> page_refcount[NPAGES];
+
+
+// is_managed_pa(pa)
+//    Return true iff `pa` belongs to a page handed out by `kallocpage()`.
+
+static bool is_managed_pa(uintptr_t pa) {
+    return pa < MEMSIZE_PHYSICAL
+        && physical_ranges.type(pa) == mem_available;
+}
+
 
 x86_64_page* kallocpage() {
     auto irqs = page_lock.lock();
 
     x86_64_page* p = nullptr;
 
-    // skip over reserved and kernel memory
-    auto range = physical_ranges.find(next_free_pa);
-    while (range != physical_ranges.end()) {
-        if (range->type() == mem_available) {
-            // use this page
-            p = pa2ka<x86_64_page*>(next_free_pa);
-            next_free_pa += PAGESIZE;
-            break;
-        } else {
-            // move to next range
-            next_free_pa = range->last();
-            ++range;
+    if (free_list) {
+        // reuse a freed page
+        p = free_list;
+        free_list = *reinterpret_cast<x86_64_page**>(p);
+    } else {
+        // skip over reserved and kernel memory
+        auto range = physical_ranges.find(next_free_pa);
+        while (range != physical_ranges.end()) {
+            if (range->type() == mem_available) {
+                // use this page
+                p = pa2ka<x86_64_page*>(next_free_pa);
+                next_free_pa += PAGESIZE;
+                break;
+            } else {
+                // move to next range
+                next_free_pa = range->last();
+                ++range;
+            }
         }
     }
 
+    if (p) {
+        page_refcount[ka2pa(p) / PAGESIZE].store(1);
+    }
+
     page_lock.unlock(irqs);
     return p;
 }
+
+
+// kfree(p)
+//    Drop a reference to page `p`, freeing it if that was the last.
+//    Does nothing if `p` is nullptr or not an allocator page.
+
+void kfree(x86_64_page* p) {
+    if (!p) {
+        return;
+    }
+    uintptr_t pa = ka2pa(p);
+    assert((pa & PAGEOFFMASK) == 0);
+    if (!is_managed_pa(pa)) {
+        return;
+    }
+    unsigned old = page_refcount[pa / PAGESIZE].fetch_sub(1);
+    assert(old > 0);
+    if (old == 1) {
+        auto irqs = page_lock.lock();
+        *reinterpret_cast<x86_64_page**>(p) = free_list;
+        free_list = p;
+        page_lock.unlock(irqs);
+    }
+}
+
+
+// kfree_pages(pages, n)
+//    Drop a reference to each page in `pages[0..n)`. Pages whose last
+//    reference goes are returned to the free list under one lock
+//    acquisition.
+
+void kfree_pages(x86_64_page** pages, size_t n) {
+    x86_64_page* head = nullptr;
+    x86_64_page** tailp = &head;
+    for (size_t i = 0; i != n; ++i) {
+        if (!pages[i]) {
+            continue;
+        }
+        uintptr_t pa = ka2pa(pages[i]);
+        assert((pa & PAGEOFFMASK) == 0);
+        if (!is_managed_pa(pa)) {
+            continue;
+        }
+        unsigned old = page_refcount[pa / PAGESIZE].fetch_sub(1);
+        assert(old > 0);
+        if (old == 1) {
+            *tailp = pages[i];
+            tailp = reinterpret_cast<x86_64_page**>(pages[i]);
+        }
+    }
+    if (head) {
+        auto irqs = page_lock.lock();
+        *tailp = free_list;
+        free_list = head;
+        page_lock.unlock(irqs);
+    }
+}
+
+
+// kincref(p)
+//    Add a reference to allocated page `p`.
+
+void kincref(x86_64_page* p) {
+    uintptr_t pa = ka2pa(p);
+    if (is_managed_pa(pa)) {
+        unsigned old = page_refcount[pa / PAGESIZE].fetch_add(1);
+        assert(old > 0);
+    }
+}
+
+
+// krefcount(p)
+//    Return the number of references to page `p`, or 0 if `p` is not
+//    an allocator page.
+
+unsigned krefcount(x86_64_page* p) {
+    uintptr_t pa = ka2pa(p);
+    if (is_managed_pa(pa)) {
+        return page_refcount[pa / PAGESIZE].load();
+    } else {
+        return 0;
+    }
+}
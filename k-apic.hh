@@ -73,6 +73,7 @@ class lapicstate {
 
     // send an IPI to all other processes
     inline void ipi_others(ipi_type_t ipi_type, int vector = 0);
+    inline void ipi(int apic_id, int vector);
     // return if the previous IPI has not completed
     inline bool ipi_pending() const;
 
@@ -155,6 +156,10 @@ inline void lapicstate::ack() {
 inline void lapicstate::ipi_others(ipi_type_t t, int vector) {
     write(reg_icr_low, ipi_all_excluding_self | ipi_level_assert | t | vector);
 }
+inline void lapicstate::ipi(int apic_id, int vector) {
+    write(reg_icr_high, unsigned(apic_id) << 24);
+    write(reg_icr_low, ipi_given | ipi_level_assert | vector);
+}
 inline bool lapicstate::ipi_pending() const {
     return (read(reg_icr_low) & ipi_delivery_status) != 0;
 }
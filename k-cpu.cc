@@ -30,6 +30,16 @@ void cpustate::init() {
     runq_lock_.clear();
     idle_task_ = nullptr;
     spinlock_depth_ = 0;
+    pcid_gen_ = 1;
+    pcid_next_ = PCID_KERNEL + 1;
+    tlb_lock_.clear();
+    tlb_nqueue_ = 0;
+    tlb_flush_all_ = false;
+    tlb_req_ = tlb_done_ = 0;
+    rcu_head_ = nullptr;
+    rcu_tailp_ = &rcu_head_;
+    memset(kstats_, 0, sizeof(kstats_));
+    fpu_owner_ = nullptr;
 
     // now initialize the CPU hardware
     init_cpu_hardware();
@@ -48,6 +58,24 @@ void cpustate::enqueue(proc* p) {
 }
 
 
+// proc::wake()
+//    Make this process runnable if it is blocked. If it is not
+//    currently running on its home CPU, enqueue it there; otherwise
+//    `cpustate::schedule()` will re-enqueue it when it yields.
+
+void proc::wake() {
+    cpustate* c = &cpus[cpu_];
+    auto irqs = c->runq_lock_.lock();
+    if (state_ == proc::blocked) {
+        state_ = proc::runnable;
+        if (!runq_pprev_ && c->current_ != this) {
+            c->enqueue(this);
+        }
+    }
+    c->runq_lock_.unlock(irqs);
+}
+
+
 // cpustate::schedule(yielding_from)
 //    Run a process, or the current CPU's idle task if no runnable
 //    process exists. If `yielding_from != nullptr`, then do not
@@ -57,6 +85,14 @@ void cpustate::schedule(proc* yielding_from) {
     assert(is_cli());              // interrupts are currently disabled
     assert(spinlock_depth_ == 0);  // no spinlocks are held
 
+    // an exited process may be freed once this CPU is quiescent
+    if (current_ && current_->state_ == proc::exited) {
+        current_ = yielding_from = nullptr;
+    }
+
+    // this CPU holds no RCU references
+    rcu_quiescent();
+
     // do not run idle task unless nothing else is runnable
     if (current_ == idle_task_) {
         current_ = nullptr;
@@ -67,7 +103,13 @@ void cpustate::schedule(proc* yielding_from) {
         if (current_
             && current_->state_ == proc::runnable
             && current_ != yielding_from) {
-            set_pagetable(current_->pagetable_);
+            kstat_add(kstat_context_switches);
+            if (current_->kinfo_) {
+                current_->kinfo_->cpu = index_;
+                ++current_->kinfo_->runs;
+            }
+            load_pagetable(current_);
+            fpu_switch(current_);
             current_->resume();
         }
 
@@ -78,9 +120,10 @@ void cpustate::schedule(proc* yielding_from) {
             if (current_->state_ == proc::runnable) {
                 enqueue(current_);
             }
-            current_ = yielding_from = nullptr;
             // switch to a safe page table
-            lcr3(ktext2pa(early_pagetable));
+            set_pagetable(early_pagetable);
+            current_->active_cpus_ &= ~(1U << index_);
+            current_ = yielding_from = nullptr;
         }
         if (runq_head_) {
             // pop head of run queue into `current_`
@@ -108,11 +151,14 @@ void cpustate::schedule(proc* yielding_from) {
 //    Every CPU has an *idle task*, which is a kernel task (i.e., a
 //    `proc` that runs in kernel mode) that just stops the processor
 //    until an interrupt is received. The idle task runs when a CPU
-//    has nothing better to do.
+//    has nothing better to do. Each pass through the idle loop is an
+//    RCU quiescent state.
 
 void idle(proc*) {
     while (1) {
-        asm volatile("hlt");
+        cli();
+        rcu_quiescent();
+        asm volatile("sti; hlt" : : : "memory");
     }
 }
 
@@ -120,6 +166,48 @@ proc* cpustate::idle_task() {
     if (!idle_task_) {
         idle_task_ = reinterpret_cast<proc*>(kallocpage());
         idle_task_->init_kernel(-1, idle);
+        idle_task_->cpu_ = index_;
     }
     return idle_task_;
 }
+
+
+// cpustate::load_pagetable(p)
+//    Install `p`'s page table on this CPU. With PCIDs, `p` is assigned a
+//    PCID on each CPU it runs on, tagged with that CPU's PCID generation.
+//    While the tag is current, `p`'s TLB entries survive context
+//    switches. When a generation's PCIDs run out, the whole TLB is
+//    flushed and a new generation starts, invalidating all older tags.
+
+void cpustate::load_pagetable(proc* p) {
+    if (p->pagetable_ == early_pagetable) {
+        set_pagetable(p->pagetable_);
+        return;
+    }
+    // Mark `p` active before reading its PCID tag. `tlb_batch::flush()`
+    // clears tags before reading `active_cpus_`, so either it sees us
+    // here and sends an IPI, or we see its cleared tag and flush.
+    p->active_cpus_ |= 1U << index_;
+    if (!pcid_enabled) {
+        set_pagetable(p->pagetable_);
+        return;
+    }
+
+    uintptr_t pa = ka2pa(p->pagetable_);
+    uint64_t tag = __atomic_load_n(&p->pcid_tag_[index_], __ATOMIC_RELAXED);
+    if ((tag >> 12) == pcid_gen_) {
+        lcr3(pa | (tag & CR3_PCIDMASK) | CR3_NOFLUSH);
+        return;
+    }
+
+    if (pcid_next_ == PCID_SCRATCH) {
+        tlbflush_all();
+        ++pcid_gen_;
+        pcid_next_ = PCID_KERNEL + 1;
+    }
+    tag = (pcid_gen_ << 12) | pcid_next_;
+    ++pcid_next_;
+    p->pcid_tag_[index_] = tag;
+    // flush on first use so the PCID starts out clean
+    lcr3(pa | (tag & CR3_PCIDMASK));
+}
@@ -0,0 +1,158 @@
+#include "kernel.hh"
+
+// k-fpu.cc
+//
+//    Lazy FPU, SSE, and AVX state. The kernel is compiled without SSE and
+//    never touches these registers, so they need saving only when a
+//    different process wants them. Each CPU remembers the process whose
+//    state its registers hold, `cpustate::fpu_owner_`, and sets CR0_TS
+//    while any other process runs. That process's first FPU instruction
+//    then traps with #NM, and `proc::fpu_trap` saves the owner's
+//    registers, loads the new process's, and makes it the owner. A
+//    process that never uses the FPU has no state area and costs nothing
+//    at context switches; one that uses it alone on its CPU never has its
+//    state saved at all. Processes never leave their home CPU, so a
+//    process's live state can only be on `cpus[cpu_]`.
+//
+//    State is saved with XSAVEOPT (or XSAVE) if the processor supports
+//    XSAVE, and with FXSAVE otherwise. Each state area is one page.
+
+static bool fpu_xsave;          // use the XSAVE instruction family
+static bool fpu_xsaveopt;       // XSAVEOPT is available
+static uint64_t fpu_xcr0;       // state components enabled in %xcr0
+
+
+// cpustate::init_fpu()
+//    Enable SSE, and XSAVE and AVX if available, on this CPU, and make
+//    the first FPU use trap.
+
+void cpustate::init_fpu() {
+    lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_TS);
+    fpu_ts_ = true;
+
+    uint64_t cr4 = rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (cpuid(1).ecx & (1U << 26)) {
+        lcr4(cr4 | CR4_OSXSAVE);
+        auto leaf = cpuid(0xD, 0);
+        uint64_t supported = leaf.eax | (uint64_t(leaf.edx) << 32);
+        fpu_xcr0 = supported & (XCR0_X87 | XCR0_SSE | XCR0_AVX);
+        xsetbv(0, fpu_xcr0);
+        // %ebx now reports the area size for the enabled components
+        assert(cpuid(0xD, 0).ebx <= PAGESIZE);
+        fpu_xsaveopt = cpuid(0xD, 1).eax & 1;
+        fpu_xsave = true;
+    } else {
+        lcr4(cr4);
+    }
+}
+
+
+// fpu_save(area), fpu_restore(area)
+//    Save this CPU's FPU state to `area`, or load it from `area`.
+//    CR0_TS must be clear.
+
+static void fpu_save(x86_64_page* area) {
+    uint32_t lo = fpu_xcr0, hi = fpu_xcr0 >> 32;
+    if (fpu_xsaveopt) {
+        asm volatile("xsaveopt64 %0" : "+m" (*area) : "a" (lo), "d" (hi));
+    } else if (fpu_xsave) {
+        asm volatile("xsave64 %0" : "+m" (*area) : "a" (lo), "d" (hi));
+    } else {
+        asm volatile("fxsave64 %0" : "+m" (*area));
+    }
+}
+
+static void fpu_restore(x86_64_page* area) {
+    uint32_t lo = fpu_xcr0, hi = fpu_xcr0 >> 32;
+    if (fpu_xsave) {
+        asm volatile("xrstor64 %0" : : "m" (*area), "a" (lo), "d" (hi));
+    } else {
+        asm volatile("fxrstor64 %0" : : "m" (*area));
+    }
+}
+
+
+// cpustate::fpu_switch(p)
+//    Set CR0_TS for running `p` unless `p` owns this CPU's FPU state.
+//    Kernel tasks never use the FPU, so they leave CR0_TS alone.
+
+void cpustate::fpu_switch(proc* p) {
+    if (p->pagetable_ == early_pagetable) {
+        return;
+    }
+    bool ts = p != fpu_owner_;
+    if (ts != fpu_ts_) {
+        if (ts) {
+            lcr0(rcr0() | CR0_TS);
+        } else {
+            clts();
+        }
+        fpu_ts_ = ts;
+    }
+}
+
+
+// proc::fpu_trap()
+//    Handle this process's #NM exception by giving it this CPU's FPU. A
+//    first use gets the initial state: all registers zero, with every
+//    exception masked. Returns false if no state area could be allocated.
+
+bool proc::fpu_trap() {
+    cpustate* c = this_cpu();
+    assert(c->fpu_owner_ != this);
+    if (!fpu_state_) {
+        fpu_state_ = kallocpage();
+        if (!fpu_state_) {
+            return false;
+        }
+        // A zero XSAVE header puts every component in its initial state,
+        // except %mxcsr, which is always loaded from the legacy area.
+        memset(fpu_state_, 0, PAGESIZE);
+        uint8_t* legacy = reinterpret_cast<uint8_t*>(fpu_state_);
+        *reinterpret_cast<uint16_t*>(legacy) = 0x37F;           // FCW
+        *reinterpret_cast<uint32_t*>(legacy + 24) = 0x1F80;     // MXCSR
+    }
+
+    clts();
+    c->fpu_ts_ = false;
+    if (c->fpu_owner_) {
+        fpu_save(c->fpu_owner_->fpu_state_);
+    }
+    fpu_restore(fpu_state_);
+    c->fpu_owner_ = this;
+    return true;
+}
+
+
+// proc::fpu_fork(child)
+//    Give `child` a copy of this process's FPU state, if it has any.
+//    Returns 0 or E_NOMEM.
+
+int proc::fpu_fork(proc* child) {
+    if (!fpu_state_) {
+        return 0;
+    }
+    child->fpu_state_ = kallocpage();
+    if (!child->fpu_state_) {
+        return E_NOMEM;
+    }
+    // as the running owner, this process has CR0_TS clear
+    if (this_cpu_read(fpu_owner_) == this) {
+        fpu_save(fpu_state_);
+    }
+    memcpy(child->fpu_state_, fpu_state_, PAGESIZE);
+    return 0;
+}
+
+
+// proc::fpu_free()
+//    Free this process's FPU state. Its registers' contents are dropped,
+//    not saved.
+
+void proc::fpu_free() {
+    if (cpu_ >= 0 && cpus[cpu_].fpu_owner_ == this) {
+        cpus[cpu_].fpu_owner_ = nullptr;
+    }
+    kfree(fpu_state_);
+    fpu_state_ = nullptr;
+}
@@ -0,0 +1,95 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-futex.cc
+//
+//    Fast user-space mutexes. A futex is a 32-bit word in user memory.
+//    Waiters are kept in a hash table of wait queues keyed by the word's
+//    *physical* address, so processes that share a page (at any virtual
+//    address) share the futex.
+
+#define NFUTEXBUCKETS 64
+
+static wait_queue futex_buckets[NFUTEXBUCKETS];
+static std::atomic<int> futex_ntimed;   // # waiters with deadlines
+
+static wait_queue& futex_bucket(uintptr_t pa) {
+    uintptr_t h = pa >> 2;
+    h ^= h >> 7;
+    return futex_buckets[h % NFUTEXBUCKETS];
+}
+
+
+// futex_word(p, addr)
+//    Return a kernel pointer to the user futex word at `addr` in `p`,
+//    or nullptr if `addr` is misaligned or not user-accessible.
+
+static std::atomic<int>* futex_word(proc* p, uintptr_t addr) {
+    if (addr & 3) {
+        return nullptr;
+    }
+    vmiter it(p, addr);
+    if (!it.user()) {
+        return nullptr;
+    }
+    return it.ka<std::atomic<int>*>();
+}
+
+
+int futex_wait(proc* p, uintptr_t addr, int expected, unsigned long timeout) {
+    std::atomic<int>* word = futex_word(p, addr);
+    if (!word) {
+        return E_FAULT;
+    }
+    uintptr_t key = ka2pa(word);
+    wait_queue& wq = futex_bucket(key);
+
+    auto irqs = wq.lock_.lock();
+    // A waker changes the word before taking the bucket lock, so
+    // checking the word under the lock cannot miss a wakeup.
+    if (word->load() != expected) {
+        wq.lock_.unlock(irqs);
+        return E_AGAIN;
+    }
+    p->wq_key_ = key;
+    p->wq_result_ = 0;
+    p->wq_deadline_ = 0;
+    if (timeout) {
+        unsigned long deadline = ktime.ticks() + timeout;
+        p->wq_deadline_ = deadline ? deadline : 1;
+        ++futex_ntimed;
+    }
+    wq.block(p, irqs);
+
+    if (timeout) {
+        --futex_ntimed;
+    }
+    p->wq_key_ = 0;
+    p->wq_deadline_ = 0;
+    return p->wq_result_;
+}
+
+
+int futex_wake(proc* p, uintptr_t addr, int n) {
+    std::atomic<int>* word = futex_word(p, addr);
+    if (!word) {
+        return E_FAULT;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    uintptr_t key = ka2pa(word);
+    return futex_bucket(key).wake_key(key, n);
+}
+
+
+void futex_expire(unsigned long now) {
+    if (futex_ntimed.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    for (int i = 0; i != NFUTEXBUCKETS; ++i) {
+        if (!futex_buckets[i].empty()) {
+            futex_buckets[i].expire(now, E_TIMEDOUT);
+        }
+    }
+}
@@ -28,6 +28,9 @@ x86_64_pagetable* kalloc_pagetable() {
 //    Change page directory. lcr3() is the hardware instruction;
 //    set_pagetable() additionally checks that important kernel procedures are
 //    mappable in `pagetable`, and calls panic() if they aren't.
+//    With PCIDs, switching to `early_pagetable` keeps TLB entries.
+
+bool pcid_enabled;
 
 void set_pagetable(x86_64_pagetable* pagetable) {
     assert(pagetable != nullptr);          // must not be NULL
@@ -38,7 +41,13 @@ void set_pagetable(x86_64_pagetable* pagetable) {
     assert(vmiter(pagetable, KTEXT_BASE).writable());
     assert(!vmiter(pagetable, KTEXT_BASE).user());
     auto pa = is_ktext(pagetable) ? ktext2pa(pagetable) : ka2pa(pagetable);
-    lcr3(pa);
+    if (!pcid_enabled) {
+        lcr3(pa);
+    } else if (pagetable == early_pagetable) {
+        lcr3(pa | PCID_KERNEL | CR3_NOFLUSH);
+    } else {
+        lcr3(pa | PCID_SCRATCH);
+    }
 }
 
 
@@ -118,12 +127,18 @@ void reboot() {
 
 // console_show_cursor(cpos)
 //    Move the console cursor to position `cpos`, which should be between 0
-//    and 80 * 25.
+//    and 80 * 25. Port I/O is slow, so the hardware is only told when the
+//    position changes.
+
+static std::atomic<int> console_shown_cursor = -1;
 
 void console_show_cursor(int cpos) {
     if (cpos < 0 || cpos > CONSOLE_ROWS * CONSOLE_COLUMNS) {
         cpos = 0;
     }
+    if (console_shown_cursor.exchange(cpos) == cpos) {
+        return;
+    }
     outb(0x3D4, 14);
     outb(0x3D5, cpos / 256);
     outb(0x3D4, 15);
@@ -353,15 +368,19 @@ void error_printf(const char* format, ...) {
 }
 
 
-// check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
-//    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
-//    Returns key typed or -1 for no key.
+// keyboard_is_control(c)
+//    Return true if `c` is a control key: 'a', 'f', and 'e' cause a soft
+//    reboot, and Control-C or 'q' exit the virtual machine.
 
-int check_keyboard() {
-    // XXX THIS WILL FAIL MISERABLY ON MULTICORE!!!!!!
-    int c = keyboard_readc();
+static bool keyboard_is_control(int c) {
+    return c == 'a' || c == 'f' || c == 'e' || c == 0x03 || c == 'q';
+}
+
+
+// keyboard_control(c)
+//    Act on `c` if it is a control key. Does not return if it is.
+
+static void keyboard_control(int c) {
     if (c == 'a' || c == 'f' || c == 'e') {
         // Install a temporary page table to carry us through the
         // process of reinitializing memory. This replicates work the
@@ -390,6 +409,73 @@ int check_keyboard() {
     } else if (c == 0x03 || c == 'q') {
         poweroff();
     }
+}
+
+
+// check_keyboard
+//    Poll the keyboard for the user typing a control key (see
+//    `keyboard_control`). Returns key typed or -1 for no key. Only for use
+//    with interrupts disabled, such as after a panic; otherwise the
+//    keyboard interrupt handler reads the keyboard.
+
+int check_keyboard() {
+    int c = keyboard_readc();
+    keyboard_control(c);
+    return c;
+}
+
+
+// Keyboard ring buffer
+//    `keyboard_interrupt` fills it; `keyboard_getc` drains it. The lock
+//    also protects `keyboard_readc`'s modifier state.
+
+#define KEYBOARD_BUFSIZE 128
+
+static spinlock keyboard_lock;
+static int keyboard_buf[KEYBOARD_BUFSIZE];
+static unsigned keyboard_head;      // next slot to read
+static unsigned keyboard_tail;      // next slot to write
+
+
+// keyboard_interrupt()
+//    Handle a keyboard interrupt: read every pending key, queue ordinary
+//    keys, and acknowledge the interrupt. Keys arriving while the buffer
+//    is full are dropped. A control key stops the reading; since it never
+//    returns, it is acted on only once `keyboard_lock` is released and
+//    the interrupt acknowledged, so the rebooted kernel finds both free.
+
+void keyboard_interrupt() {
+    auto irqs = keyboard_lock.lock();
+    int c, control = -1;
+    while ((c = keyboard_readc()) >= 0) {
+        if (c == 0) {
+            continue;
+        } else if (keyboard_is_control(c)) {
+            control = c;
+            break;
+        }
+        if (keyboard_tail - keyboard_head != KEYBOARD_BUFSIZE) {
+            keyboard_buf[keyboard_tail % KEYBOARD_BUFSIZE] = c;
+            ++keyboard_tail;
+        }
+    }
+    keyboard_lock.unlock(irqs);
+    lapicstate::get().ack();
+    keyboard_control(control);
+}
+
+
+// keyboard_getc()
+//    Return the oldest key queued by `keyboard_interrupt`, or -1 if none.
+
+int keyboard_getc() {
+    auto irqs = keyboard_lock.lock();
+    int c = -1;
+    if (keyboard_head != keyboard_tail) {
+        c = keyboard_buf[keyboard_head % KEYBOARD_BUFSIZE];
+        ++keyboard_head;
+    }
+    keyboard_lock.unlock(irqs);
     return c;
 }
 
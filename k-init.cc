@@ -88,7 +88,7 @@ static void set_gate(x86_64_gatedescriptor* gate, int type, int dpl,
     gate->gd_high = function >> 32;
 }
 
-x86_64_pagetable __section(".lowdata") early_pagetable[2];
+x86_64_pagetable __section(".lowdata") early_pagetable[3];
 uint64_t __section(".lowdata") early_gdt_segments[3];
 x86_64_pseudodescriptor __section(".lowdata") early_gdt;
 
@@ -107,17 +107,24 @@ void init_early_memory() {
 
     // initialize early page table
     memset(early_pagetable, 0, sizeof(early_pagetable));
-    // high canonical addresses
+    // high canonical addresses; these are the same in every address
+    // space, so they are global and survive %cr3 reloads (once
+    // CR4_PGE is enabled in `init_cpu_hardware()`)
     early_pagetable->entry[256] = ktext2pa(&early_pagetable[1]) | PTE_P | PTE_W;
     for (uintptr_t p = 0; p < 510; ++p) {
-        early_pagetable[1].entry[p] = (p << 30) | PTE_P | PTE_W | PTE_PS;
+        early_pagetable[1].entry[p] = (p << 30) | PTE_P | PTE_W | PTE_PS
+            | PTE_G;
     }
     // kernel text addresses
     early_pagetable->entry[511] = early_pagetable->entry[256];
     early_pagetable[1].entry[510] = early_pagetable[1].entry[0];
     early_pagetable[1].entry[511] = early_pagetable[1].entry[1];
-    // physically-mapped low canonical addresses
-    early_pagetable->entry[0] = early_pagetable->entry[256];
+    // physically-mapped low canonical addresses; these must not be
+    // global, since process page tables map low addresses differently
+    for (uintptr_t p = 0; p < 512; ++p) {
+        early_pagetable[2].entry[p] = early_pagetable[1].entry[p] & ~PTE_G;
+    }
+    early_pagetable->entry[0] = ktext2pa(&early_pagetable[2]) | PTE_P | PTE_W;
 
     lcr3(ktext2pa(early_pagetable));
 
@@ -157,6 +164,13 @@ void init_interrupts() {
 #define IO_PIC2         0xA0    // Slave (IRQs 8-15)
     outb(IO_PIC1 + 1, 0xFF);
     outb(IO_PIC2 + 1, 0xFF);
+
+    // deliver keyboard interrupts to this CPU through the IOAPIC, and
+    // drain stale input so the next keypress raises a new interrupt
+    ioapic.enable_irq(IRQ_KEYBOARD, INT_IRQ + IRQ_KEYBOARD,
+                      lapicstate::get().id());
+    while (keyboard_readc() >= 0) {
+    }
 }
 
 
@@ -242,11 +256,28 @@ void cpustate::init_cpu_hardware() {
     cr0 |= CR0_PE | CR0_PG | CR0_WP | CR0_AM | CR0_MP | CR0_NE;
     lcr0(cr0);
 
+    // enable global pages, so kernel TLB entries survive %cr3 reloads
+    lcr4(rcr4() | CR4_PGE);
+
+    // enable process-context identifiers, if available, so context
+    // switches need not flush the TLB (%cr3 must hold PCID 0 here)
+    if (cpuid(1).ecx & (1U << 17)) {
+        assert((rcr3() & CR3_PCIDMASK) == PCID_KERNEL);
+        lcr4(rcr4() | CR4_PCIDE);
+        pcid_enabled = true;
+    }
+
+    // enable SSE and AVX state, saved lazily (see `k-fpu.cc`)
+    init_fpu();
+
 
     // set up syscall/sysret
     wrmsr(MSR_IA32_KERNEL_GS_BASE, reinterpret_cast<uint64_t>(this));
+    // `syscall` loads %cs from STAR[47:32] and %ss 8 bytes later;
+    // `sysretq` loads %ss from STAR[63:48] + 8 and %cs 8 bytes later
+    static_assert(SEGSEL_APP_CODE == SEGSEL_APP_DATA + 8, "sysret layout");
     wrmsr(MSR_IA32_STAR, (uintptr_t(SEGSEL_KERN_CODE) << 32)
-          | (uintptr_t(SEGSEL_APP_CODE) << 48));
+          | (uintptr_t(SEGSEL_APP_DATA - 8) << 48));
     wrmsr(MSR_IA32_LSTAR, reinterpret_cast<uint64_t>(syscall_entry));
     wrmsr(MSR_IA32_FMASK, EFLAGS_TF | EFLAGS_DF | EFLAGS_IF
           | EFLAGS_IOPL_MASK | EFLAGS_AC | EFLAGS_NT);
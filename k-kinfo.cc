@@ -0,0 +1,60 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-kinfo.cc
+//
+//    Kernel information pages. Every process maps the shared time page
+//    at KINFO_TIME_ADDR and its own `kinfo_proc` page at KINFO_PROC_ADDR,
+//    both read-only, so it can read the time, its PID, and similar
+//    information without a system call (see `p-lib.hh`). The pages are
+//    mapped `PTE_SHARED`, which keeps the page deduplicator away from
+//    them; `sys_fork` gives each child its own `kinfo_proc` page instead
+//    of sharing the parent's.
+
+// The time page lives in the kernel image, so it is not reference
+// counted and freeing a process's user pages leaves it alone. It fills
+// a whole page: user code must see nothing else.
+static x86_64_page kinfo_time_page __attribute__((aligned(PAGESIZE)));
+
+
+// kinfo_update_time(t)
+//    Publish time snapshot `t` on the time page. Called by CPU 0 with the
+//    timekeeper's write lock held, so there is only one writer.
+
+void kinfo_update_time(const ktime_snapshot& t) {
+    kinfo_time* kt = reinterpret_cast<kinfo_time*>(&kinfo_time_page);
+    uint32_t seq = kt->seq;
+    __atomic_store_n(&kt->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&kt->hz, HZ, __ATOMIC_RELAXED);
+    __atomic_store_n(&kt->ticks, t.ticks, __ATOMIC_RELAXED);
+    __atomic_store_n(&kt->tsc_base, t.tsc_base, __ATOMIC_RELAXED);
+    __atomic_store_n(&kt->tsc_hz, t.tsc_hz, __ATOMIC_RELAXED);
+    __atomic_store_n(&kt->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+// proc::map_kinfo()
+//    Map the kernel information pages into this new user process, whose
+//    `pid_` and `ppid_` are set. Returns 0 or E_NOMEM.
+
+int proc::map_kinfo() {
+    assert(!kinfo_);
+    x86_64_page* pg = kallocpage();
+    if (!pg) {
+        return E_NOMEM;
+    }
+    memset(pg, 0, PAGESIZE);
+    int perm = PTE_P | PTE_U | PTE_SHARED;
+    uintptr_t time_pa = ktext2pa(&kinfo_time_page);
+    if (vmiter(this, KINFO_TIME_ADDR).map(time_pa, perm) < 0
+        || vmiter(this, KINFO_PROC_ADDR).map(ka2pa(pg), perm) < 0) {
+        kfree(pg);
+        return E_NOMEM;
+    }
+    kinfo_ = reinterpret_cast<kinfo_proc*>(pg);
+    kinfo_->pid = pid_;
+    kinfo_->ppid = ppid_;
+    kinfo_->cpu = cpu_;
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-ksm.cc
+//
+//    Same-page merging. A kernel task, `ksmd`, periodically scans the
+//    private user pages of every process, hashing each one. Pages whose
+//    contents match a *stable* page are remapped onto it read-only and
+//    copy-on-write, and freed; the normal copy-on-write fault path
+//    breaks sharing on write. A page becomes stable once a second page
+//    with its hash turns up during a pass: hashes seen once are kept in
+//    an *unstable* list that is emptied every pass, so pages that change
+//    between passes are rarely write-protected. The stable table holds a
+//    reference to each of its pages, whose contents never change since
+//    all their mappings are copy-on-write.
+//
+//    `ksmd` changes other processes' page tables, so it holds the
+//    owner's `proc::vmlock_`, which every path that changes a process's
+//    page table takes too. It only try-locks: a busy process is skipped
+//    until the next pass. Before comparing a candidate page, `ksmd`
+//    write-protects it and flushes its TLB entries, so the owner cannot
+//    change it during the comparison.
+
+#define KSM_NSTABLE             128
+#define KSM_NUNSTABLE           256
+#define KSM_INTERVAL            (HZ / 5)    // ticks between passes
+
+struct ksm_stable_page {
+    uint64_t hash_;
+    x86_64_page* page_;         // nullptr if unused
+};
+
+static ksm_stable_page ksm_stable[KSM_NSTABLE];
+static uint64_t ksm_unstable[KSM_NUNSTABLE];
+static int ksm_nunstable;
+static uint64_t ksm_saved;      // pages saved at the end of the last pass
+static wait_queue ksm_wq;       // `ksmd` sleeps here between passes
+
+// These are used only by `ksmd`, so they need no lock.
+
+
+// ksm_hash(pg)
+//    Return a hash of the contents of page `pg`.
+
+static uint64_t ksm_hash(const x86_64_page* pg) {
+    const uint64_t* w = reinterpret_cast<const uint64_t*>(pg);
+    uint64_t h = 14695981039346656037UL;
+    for (size_t i = 0; i != PAGESIZE / sizeof(uint64_t); ++i) {
+        h = (h ^ w[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+
+// ksm_seen(h)
+//    Return true if hash `h` was already seen in this pass; otherwise
+//    remember it and return false.
+
+static bool ksm_seen(uint64_t h) {
+    for (int i = 0; i != ksm_nunstable; ++i) {
+        if (ksm_unstable[i] == h) {
+            return true;
+        }
+    }
+    if (ksm_nunstable != KSM_NUNSTABLE) {
+        ksm_unstable[ksm_nunstable] = h;
+        ++ksm_nunstable;
+    }
+    return false;
+}
+
+
+// ksm_scan_page(p, it)
+//    Try to merge the page mapped at `it` in process `p`, whose
+//    `vmlock_` is held.
+
+static void ksm_scan_page(proc* p, vmiter& it) {
+    x86_64_page* pg = it.ka<x86_64_page*>();
+    // only private 4KiB pages used by one mapping
+    if (it.level() != 0
+        || (it.perm() & PTE_SHARED)
+        || krefcount(pg) != 1) {
+        return;
+    }
+    kstat_add(kstat_ksm_scanned);
+
+    uint64_t h = ksm_hash(pg);
+    ksm_stable_page* match = nullptr;
+    ksm_stable_page* free_slot = nullptr;
+    for (int i = 0; i != KSM_NSTABLE && !match; ++i) {
+        if (!ksm_stable[i].page_) {
+            free_slot = free_slot ? free_slot : &ksm_stable[i];
+        } else if (ksm_stable[i].hash_ == h) {
+            match = &ksm_stable[i];
+        }
+    }
+    if (!match && (!free_slot || !ksm_seen(h))) {
+        return;
+    }
+
+    // freeze the page's contents
+    int perm = it.perm();
+    if (perm & PTE_W) {
+        perm = (perm & ~PTE_W) | PTE_COW;
+        int r = it.map(it.pa(), perm);
+        assert(r == 0);
+        tlb_batch(p).add(it.va());
+    }
+
+    if (match) {
+        if (memcmp(pg, match->page_, PAGESIZE) == 0) {
+            kincref(match->page_);
+            int r = it.map(ka2pa(match->page_), perm);
+            assert(r == 0);
+            tlb_batch tlb(p);
+            tlb.add(it.va());
+            tlb.free_page(pg);
+            kstat_add(kstat_ksm_merged);
+        }
+    } else if (ksm_hash(pg) == h) {
+        kincref(pg);
+        free_slot->hash_ = h;
+        free_slot->page_ = pg;
+    }
+}
+
+
+// ksm_pass()
+//    Scan every process once, then drop stable pages no process maps.
+
+static void ksm_pass() {
+    uint64_t start = rdtsc();
+    ksm_nunstable = 0;
+
+    for (pid_t pid = 1; pid != NPROC; ++pid) {
+        // A locked `vmlock_` keeps the process from exiting, so it
+        // outlives the RCU read-side critical section.
+        auto irqs = rcu_read_lock();
+        proc* p = ptable_lookup(pid);
+        bool locked = p && p->vmlock_.try_lock();
+        rcu_read_unlock(irqs);
+        if (!locked) {
+            continue;
+        }
+        for (vmiter it(p, 0); it.low(); it.next()) {
+            if (it.user()) {
+                ksm_scan_page(p, it);
+            }
+        }
+        p->vmlock_.unlock();
+    }
+
+    // Each stable page with `n > 1` references (one is the table's)
+    // stands in for `n - 1` copies.
+    uint64_t saved = 0;
+    for (int i = 0; i != KSM_NSTABLE; ++i) {
+        x86_64_page* pg = ksm_stable[i].page_;
+        if (pg && krefcount(pg) == 1) {
+            ksm_stable[i].page_ = nullptr;
+            kfree(pg);
+        } else if (pg) {
+            saved += krefcount(pg) - 2;
+        }
+    }
+    kstat_add(kstat_ksm_saved, saved - ksm_saved);
+    ksm_saved = saved;
+    kstat_add(kstat_ksm_cycles, rdtsc() - start);
+}
+
+
+// ksmd(self)
+//    The page deduplicator kernel task.
+
+static void ksmd(proc* self) {
+    while (1) {
+        ksm_pass();
+
+        auto irqs = ksm_wq.lock_.lock();
+        self->wq_deadline_ = ktime.ticks() + KSM_INTERVAL;
+        ksm_wq.block(self, irqs);
+        self->wq_deadline_ = 0;
+    }
+}
+
+
+void ksm_start() {
+    proc* p = reinterpret_cast<proc*>(kallocpage());
+    assert(p);
+    p->init_kernel(-1, ksmd);
+    int cpu = ncpu - 1;
+    p->cpu_ = cpu;
+    auto irqs = cpus[cpu].runq_lock_.lock();
+    cpus[cpu].enqueue(p);
+    cpus[cpu].runq_lock_.unlock(irqs);
+}
+
+
+void ksm_expire(unsigned long now) {
+    if (!ksm_wq.empty()) {
+        ksm_wq.expire(now, 0);
+    }
+}
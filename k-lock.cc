@@ -0,0 +1,257 @@
+#include "kernel.hh"
+
+// k-lock.cc
+//
+//    Blocking synchronization: wait queues, mutexes, and condition
+//    variables. These park processes as `proc::blocked` and hand the CPU
+//    to `cpustate::schedule()`; `proc::wake()` puts them back on their
+//    home CPU's run queue.
+
+
+// wait_queue::block(p, irqs)
+//    Enqueue `p`, mark it blocked, release `lock_`, and yield.
+//    Interrupts stay disabled until `p` is rescheduled, so a timer
+//    interrupt cannot observe a half-blocked process.
+
+void wait_queue::block(proc* p, irqstate& irqs) {
+    assert(p == current());
+    p->wq_next_ = nullptr;
+    if (tail_) {
+        tail_->wq_next_ = p;
+    } else {
+        head_ = p;
+    }
+    tail_ = p;
+    p->state_ = proc::blocked;
+
+    adjust_this_cpu_spinlock_depth(-1);
+    lock_.unlock_noirq();
+    p->yield();
+    irqs.restore();
+}
+
+
+// wait_queue::erase(p)
+//    Remove `p` from the queue if it is present.
+
+bool wait_queue::erase(proc* p) {
+    proc* prev = nullptr;
+    for (proc* w = head_; w; prev = w, w = w->wq_next_) {
+        if (w == p) {
+            if (prev) {
+                prev->wq_next_ = w->wq_next_;
+            } else {
+                head_ = w->wq_next_;
+            }
+            if (tail_ == w) {
+                tail_ = prev;
+            }
+            w->wq_next_ = nullptr;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+proc* wait_queue::pop_front() {
+    proc* p = head_;
+    if (p) {
+        head_ = p->wq_next_;
+        if (!head_) {
+            tail_ = nullptr;
+        }
+        p->wq_next_ = nullptr;
+    }
+    return p;
+}
+
+
+// wait_queue::wake_one(), wait_queue::wake_all()
+//    Wake waiters in FIFO order.
+
+int wait_queue::wake_one() {
+    auto irqs = lock_.lock();
+    proc* p = pop_front();
+    lock_.unlock(irqs);
+    if (p) {
+        p->wake();
+    }
+    return p != nullptr;
+}
+
+int wait_queue::wake_all() {
+    auto irqs = lock_.lock();
+    proc* list = head_;
+    head_ = tail_ = nullptr;
+    lock_.unlock(irqs);
+
+    int n = 0;
+    while (list) {
+        proc* p = list;
+        list = p->wq_next_;
+        p->wq_next_ = nullptr;
+        p->wake();
+        ++n;
+    }
+    return n;
+}
+
+
+// wait_queue::wake_key(key, n)
+//    Wake up to `n` waiters blocked with `proc::wq_key_ == key`.
+
+int wait_queue::wake_key(uintptr_t key, int n) {
+    proc* list = nullptr;
+    proc** tailp = &list;
+    int nwoken = 0;
+
+    auto irqs = lock_.lock();
+    proc* prev = nullptr;
+    proc* w = head_;
+    while (w && nwoken < n) {
+        proc* next = w->wq_next_;
+        if (w->wq_key_ == key) {
+            if (prev) {
+                prev->wq_next_ = next;
+            } else {
+                head_ = next;
+            }
+            if (tail_ == w) {
+                tail_ = prev;
+            }
+            w->wq_next_ = nullptr;
+            *tailp = w;
+            tailp = &w->wq_next_;
+            ++nwoken;
+        } else {
+            prev = w;
+        }
+        w = next;
+    }
+    lock_.unlock(irqs);
+
+    while (list) {
+        proc* p = list;
+        list = p->wq_next_;
+        p->wq_next_ = nullptr;
+        p->wake();
+    }
+    return nwoken;
+}
+
+
+// wait_queue::expire(now, result)
+//    Wake waiters whose deadlines have passed.
+
+int wait_queue::expire(unsigned long now, int result) {
+    proc* list = nullptr;
+    int nwoken = 0;
+
+    auto irqs = lock_.lock();
+    proc* prev = nullptr;
+    proc* w = head_;
+    while (w) {
+        proc* next = w->wq_next_;
+        if (w->wq_deadline_ && (long) (now - w->wq_deadline_) >= 0) {
+            if (prev) {
+                prev->wq_next_ = next;
+            } else {
+                head_ = next;
+            }
+            if (tail_ == w) {
+                tail_ = prev;
+            }
+            w->wq_result_ = result;
+            w->wq_next_ = list;
+            list = w;
+            ++nwoken;
+        } else {
+            prev = w;
+        }
+        w = next;
+    }
+    lock_.unlock(irqs);
+
+    while (list) {
+        proc* p = list;
+        list = p->wq_next_;
+        p->wq_next_ = nullptr;
+        p->wake();
+    }
+    return nwoken;
+}
+
+
+// mutex::try_lock(), mutex::lock(), mutex::unlock()
+//    Sleeping mutual exclusion. The owner is stored as a `proc*`, so a
+//    contended locker can tell whether spinning is worthwhile: if the
+//    owner is running on another CPU it will likely release soon.
+
+bool mutex::try_lock() {
+    proc* expected = nullptr;
+    return owner_.compare_exchange_strong(expected, current());
+}
+
+void mutex::lock() {
+    proc* me = current();
+    assert(owner_.load(std::memory_order_relaxed) != me);
+
+    // adaptive spinning
+    for (int spins = 0; spins < spin_limit; ++spins) {
+        if (try_lock()) {
+            return;
+        }
+        auto irqs = rcu_read_lock();
+        proc* owner = owner_.load(std::memory_order_relaxed);
+        bool owner_running = owner
+            && owner->cpu_ >= 0
+            && cpus[owner->cpu_].current_ == owner
+            && owner->state_ == proc::runnable;
+        rcu_read_unlock(irqs);
+        if (!owner_running) {
+            break;
+        }
+        pause();
+    }
+
+    // block until the mutex is free
+    while (1) {
+        auto irqs = wq_.lock_.lock();
+        proc* expected = nullptr;
+        if (owner_.compare_exchange_strong(expected, me)) {
+            wq_.lock_.unlock(irqs);
+            return;
+        }
+        wq_.block(me, irqs);
+    }
+}
+
+void mutex::unlock() {
+    assert(owner_.load(std::memory_order_relaxed) == current());
+    owner_.store(nullptr);
+    // `lock()` rechecks the owner and enqueues itself under
+    // `wq_.lock_`, so this cannot miss a waiter
+    wq_.wake_one();
+}
+
+
+// condvar::wait(m), condvar::notify_one(), condvar::notify_all()
+
+void condvar::wait(mutex& m) {
+    proc* me = current();
+    auto irqs = wq_.lock_.lock();
+    // Release `m` while holding `wq_.lock_`: a notifier must take
+    // `wq_.lock_` too, so it cannot run before we are enqueued.
+    m.unlock();
+    wq_.block(me, irqs);
+    m.lock();
+}
+
+void condvar::notify_one() {
+    wq_.wake_one();
+}
+
+void condvar::notify_all() {
+    wq_.wake_all();
+}
@@ -3,6 +3,7 @@
 #include <atomic>
 #include <utility>
 #include "x86-64.h"
+struct proc;
 inline void adjust_this_cpu_spinlock_depth(int delta);
 
 struct irqstate {
@@ -72,4 +73,128 @@ private:
     std::atomic_flag f_;
 };
 
+
+// `seqlock` protects small, frequently-read data with a sequence
+// counter. Writers serialize on an internal spinlock and make the
+// counter odd while they update; readers never write shared memory.
+// They retry if the counter was odd or changed across their reads:
+// ```
+// unsigned seq;
+// do {
+//     seq = sl.read_begin();
+//     ... copy protected data ...
+// } while (sl.read_retry(seq));
+// ```
+
+struct seqlock {
+    unsigned read_begin() const {
+        unsigned seq;
+        while ((seq = seq_.load(std::memory_order_acquire)) & 1) {
+            pause();
+        }
+        return seq;
+    }
+    bool read_retry(unsigned seq) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq_.load(std::memory_order_relaxed) != seq;
+    }
+
+    irqstate write_lock() {
+        irqstate irqs = lock_.lock();
+        seq_.store(seq_.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return irqs;
+    }
+    void write_unlock(irqstate& irqs) {
+        seq_.store(seq_.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+        lock_.unlock(irqs);
+    }
+
+private:
+    std::atomic<unsigned> seq_;
+    spinlock lock_;
+};
+
+
+// `wait_queue` is a FIFO of blocked processes. A process blocks by
+// calling `block()` with `lock_` held; `wake_one()` and `wake_all()`
+// make waiters runnable again on their home CPUs.
+
+struct wait_queue {
+    spinlock lock_;
+
+    // Add `p` (the current process) to the queue, mark it blocked,
+    // release `lock_`, and yield until woken. `irqs` is the state
+    // returned by `lock_.lock()`.
+    void block(proc* p, irqstate& irqs);
+    // Remove `p` from the queue, if present. `lock_` must be held.
+    // Returns true iff `p` was found.
+    bool erase(proc* p);
+    // Wake the first waiter (or all waiters). Returns the number woken.
+    int wake_one();
+    int wake_all();
+    // Wake up to `n` waiters whose `proc::wq_key_` equals `key`.
+    int wake_key(uintptr_t key, int n);
+    // Wake waiters whose nonzero `proc::wq_deadline_` is at or before
+    // `now`, setting their `proc::wq_result_` to `result`.
+    int expire(unsigned long now, int result);
+
+    bool empty() const {
+        return !head_;
+    }
+    // Initialize an empty queue in uninitialized memory.
+    void clear() {
+        lock_.clear();
+        head_ = tail_ = nullptr;
+    }
+
+private:
+    proc* head_;
+    proc* tail_;
+
+    proc* pop_front();
+};
+
+
+// `mutex` is a sleeping lock owned by a process. Contended lockers spin
+// briefly while the owner is running on another CPU, then block.
+// Mutexes may be held across `proc::yield()`, but not across interrupt
+// handlers or other spinlock-protected regions.
+
+struct mutex {
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    bool is_locked() const {
+        return owner_.load(std::memory_order_relaxed) != nullptr;
+    }
+    // Initialize an unlocked mutex in uninitialized memory.
+    void clear() {
+        owner_.store(nullptr, std::memory_order_relaxed);
+        wq_.clear();
+    }
+
+private:
+    std::atomic<proc*> owner_;
+    wait_queue wq_;
+
+    static constexpr int spin_limit = 2000;
+};
+
+
+// `condvar` is a condition variable used with `mutex`.
+
+struct condvar {
+    // Atomically release `m` and block; reacquire `m` before returning.
+    void wait(mutex& m);
+    void notify_one();
+    void notify_all();
+
+private:
+    wait_queue wq_;
+};
+
 #endif
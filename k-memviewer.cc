@@ -75,9 +75,9 @@ void memusage::refresh() {
         }
     }
 
-    // must be called with `ptable_lock` held
+    // must be called within an RCU read-side critical section
     for (int pid = 1; pid < NPROC; ++pid) {
-        proc* p = ptable[pid];
+        proc* p = rcu_dereference(ptable[pid]);
         if (p) {
             mark(ka2pa(p), f_kernel | f_process(pid));
         }
@@ -159,12 +159,12 @@ uint16_t memusage::symbol_at(uintptr_t pa) const {
 void console_memviewer(const proc* vmp) {
     static memusage mu;
     mu.refresh();
-    // must be called with `ptable_lock` held
+    // must be called within an RCU read-side critical section
 
     // print physical memory
     console_printf(CPOS(0, 32), 0x0F00,
                    "PHYSICAL MEMORY                  @%d\n",
-                   ticks);
+                   ktime.ticks());
 
     for (int pn = 0; pn * PAGESIZE < MEMSIZE_PHYSICAL; ++pn) {
         if (pn % 64 == 0) {
@@ -3,7 +3,8 @@
 #include "k-vmiter.hh"
 
 proc* ptable[NPROC];            // array of process descriptor pointers
-spinlock ptable_lock;           // protects `ptable`
+spinlock ptable_lock;           // serializes `ptable` writers; readers
+                                // may instead use RCU
 
 
 // proc::init_user(pid, pt)
@@ -41,6 +42,31 @@ void proc::init_user(pid_t pid, x86_64_pagetable* pt) {
 
     runq_pprev_ = nullptr;
     runq_next_ = nullptr;
+    cpu_ = -1;
+    wq_next_ = nullptr;
+    wq_key_ = 0;
+    wq_deadline_ = 0;
+    wq_result_ = 0;
+    vmas_ = nullptr;
+    nvmas_ = 0;
+    fault_next_ = 0;
+    fault_window_ = 0;
+    wss_tick_ = 0;
+    memset(&wss_, 0, sizeof(wss_));
+    vmlock_.clear();
+    memset(pcid_tag_, 0, sizeof(pcid_tag_));
+    active_cpus_ = 0;
+    ppid_ = 0;
+    exit_status_ = 0;
+    waitq_.clear();
+    for (int i = 0; i != NSHMATTACH; ++i) {
+        shm_[i].addr_ = 0;
+        shm_[i].id_ = -1;
+    }
+    kinfo_ = nullptr;
+    ring_ = nullptr;
+    ring_poll_ = false;
+    fpu_state_ = nullptr;
 }
 
 
@@ -72,6 +98,30 @@ void proc::init_kernel(pid_t pid, void (*f)(proc*)) {
 
     runq_pprev_ = nullptr;
     runq_next_ = nullptr;
+    cpu_ = -1;
+    wq_next_ = nullptr;
+    wq_key_ = 0;
+    wq_deadline_ = 0;
+    wq_result_ = 0;
+    vmas_ = nullptr;
+    nvmas_ = 0;
+    fault_next_ = 0;
+    fault_window_ = 0;
+    wss_tick_ = 0;
+    memset(&wss_, 0, sizeof(wss_));
+    vmlock_.clear();
+    active_cpus_ = 0;
+    ppid_ = 0;
+    exit_status_ = 0;
+    waitq_.clear();
+    for (int i = 0; i != NSHMATTACH; ++i) {
+        shm_[i].addr_ = 0;
+        shm_[i].id_ = -1;
+    }
+    kinfo_ = nullptr;
+    ring_ = nullptr;
+    ring_poll_ = false;
+    fpu_state_ = nullptr;
 }
 
 
@@ -87,39 +137,61 @@ struct flatfs_file {
 #include "obj/k-flatfs.c"
 
 
+// flatfs_find(name, size)
+//    Return the contents of flatfs file `name` and store its size in
+//    `*size`, or return nullptr if there is no such file.
+
+const uint8_t* flatfs_find(const char* name, size_t* size) {
+    for (size_t i = 0; i != arraysize(flatfs_files); ++i) {
+        if (strcmp(name, flatfs_files[i].name) == 0) {
+            *size = flatfs_files[i].last - flatfs_files[i].first;
+            return flatfs_files[i].first;
+        }
+    }
+    return nullptr;
+}
+
+
 // proc::load(binary_name)
 //    Load the code corresponding to program `binary_name` into this process
 //    and set `regs_->reg_rip` to its entry point. Calls `kallocpage()`.
 //    Returns 0 on success and negative on failure (e.g. out-of-memory).
 
 int proc::load(const char* binary_name) {
-    // find `flatfs_file` for `binary_name`
-    const flatfs_file* fs = flatfs_files;
-    size_t nfiles = sizeof(flatfs_files) / sizeof(flatfs_files[0]);
-    const flatfs_file* end_fs = fs + nfiles;
-    while (fs < end_fs && strcmp(binary_name, fs->name) != 0) {
-        ++fs;
-    }
-    if (fs == end_fs) {
+    // find the flatfs file for `binary_name`
+    size_t size;
+    const uint8_t* data = flatfs_find(binary_name, &size);
+    if (!data) {
         return -1;
     }
 
     // validate the binary
-    assert(size_t(fs->last - fs->first) >= sizeof(elf_header));
-    const elf_header* eh = reinterpret_cast<const elf_header*>(fs->first);
+    assert(size >= sizeof(elf_header));
+    const elf_header* eh = reinterpret_cast<const elf_header*>(data);
     assert(eh->e_magic == ELF_MAGIC);
     assert(eh->e_phentsize == sizeof(elf_program));
     assert(eh->e_shentsize == sizeof(elf_section));
 
     // load each loadable program segment into memory
     const elf_program* ph = reinterpret_cast<const elf_program*>
-        (fs->first + eh->e_phoff);
+        (data + eh->e_phoff);
+    uintptr_t image_end = 0;
     for (int i = 0; i < eh->e_phnum; ++i) {
         if (ph[i].p_type == ELF_PTYPE_LOAD) {
-            int r = load_segment(&ph[i], fs->first + ph[i].p_offset);
+            int r = load_segment(&ph[i], data + ph[i].p_offset);
             if (r < 0) {
                 return r;
             }
+            image_end = MAX(image_end, uintptr_t(ph[i].p_va + ph[i].p_memsz));
+        }
+    }
+
+    // reserve the rest of memory below the stack as demand-zero heap
+    image_end = ROUNDUP(image_end, PAGESIZE);
+    if (image_end < MEMSIZE_VIRTUAL - USER_STACK_SIZE) {
+        int r = add_vma(image_end, MEMSIZE_VIRTUAL - USER_STACK_SIZE);
+        if (r < 0) {
+            return r;
         }
     }
 
@@ -131,36 +203,21 @@ int proc::load(const char* binary_name) {
 
 // proc::load_segment(ph, src)
 //    Load an ELF segment at virtual address `ph->p_va` into this process.
-//    Copies `[src, src + ph->p_filesz)` to `dst`, then clears
-//    `[ph->p_va + ph->p_filesz, ph->p_va + ph->p_memsz)` to 0.
-//    Calls `kallocpage` to allocate pages and uses `vmiter::map`
-//    to map them in `pagetable_`. Returns 0 on success and -1 on failure.
+//    The segment's file data is `[src, src + ph->p_filesz)`; the rest of
+//    `[ph->p_va + ph->p_filesz, ph->p_va + ph->p_memsz)` reads as 0.
+//    The segment becomes a file-backed VMA and nothing is mapped yet:
+//    the page fault handler maps file pages directly onto the binary in
+//    the kernel image as they are touched (see `proc::fault_in`), and
+//    copies only a page mixing file data and BSS. Returns 0 on success
+//    and -1 on failure.
 
 int proc::load_segment(const elf_program* ph, const uint8_t* data) {
     uintptr_t va = (uintptr_t) ph->p_va;
+    uintptr_t start = ROUNDDOWN(va, PAGESIZE);
     uintptr_t end_file = va + ph->p_filesz;
-    uintptr_t end_mem = va + ph->p_memsz;
-
-    // allocate memory
-    for (vmiter it(this, va & ~(PAGESIZE - 1));
-         it.va() < end_mem;
-         it += PAGESIZE) {
-        x86_64_page* pg = kallocpage();
-        if (!pg || it.map(ka2pa(pg)) < 0) {
-            return -1;
-        }
-        assert(it.pa() == ka2pa(pg));
-    }
-
-    // ensure new memory mappings are active
-    set_pagetable(pagetable_);
-
-    // copy data from executable image into process memory
-    memcpy((uint8_t*) va, data, end_file - va);
-    memset((uint8_t*) end_file, 0, end_mem - end_file);
-
-    // restore early pagetable
-    set_pagetable(early_pagetable);
-
-    return 0;
+    uintptr_t end_mem = ROUNDUP(va + ph->p_memsz, PAGESIZE);
+    int perm = ph->p_flags & ELF_PFLAG_WRITE ? PTE_P | PTE_W | PTE_U
+        : PTE_P | PTE_U;
+    return add_vma(start, end_mem, perm, VMA_FILE, data - (va - start),
+                   end_file);
 }
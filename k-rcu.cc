@@ -0,0 +1,70 @@
+#include "kernel.hh"
+
+// k-rcu.cc
+//
+//    Quiescent-state-based RCU.
+//
+//    The global epoch `rcu_epoch` advances from `e` to `e + 1` once
+//    every CPU has reported a quiescent state during epoch `e`. A reader
+//    that was active when a callback was queued in epoch `e` must finish
+//    before its CPU reports epoch `e + 1`, so the callback may run once
+//    the global epoch reaches `e + 2`.
+
+static std::atomic<unsigned long> rcu_epoch;
+static std::atomic<unsigned long> rcu_npending;
+
+
+// call_rcu(head, func)
+//    Queue `func(head)` on this CPU's callback list.
+
+void call_rcu(rcu_head* head, void (*func)(rcu_head*)) {
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* c = this_cpu();
+    head->rcu_next_ = nullptr;
+    head->rcu_func_ = func;
+    head->rcu_epoch_ = rcu_epoch.load();
+    *c->rcu_tailp_ = head;
+    c->rcu_tailp_ = &head->rcu_next_;
+    ++rcu_npending;
+    irqs.restore();
+}
+
+
+// rcu_quiescent()
+//    Report a quiescent state for this CPU and run expired callbacks.
+
+void rcu_quiescent() {
+    assert(is_cli());
+    cpustate* c = this_cpu();
+    assert(c->spinlock_depth_ == 0);
+
+    unsigned long e = rcu_epoch.load();
+    if (c->rcu_seen_.load(std::memory_order_relaxed) != e) {
+        c->rcu_seen_.store(e);
+    }
+
+    // Epochs only need to advance while callbacks are waiting.
+    if (rcu_npending.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    bool all_seen = true;
+    for (int i = 0; i < ncpu && all_seen; ++i) {
+        all_seen = cpus[i].rcu_seen_.load() == e;
+    }
+    if (all_seen) {
+        rcu_epoch.compare_exchange_strong(e, e + 1);
+    }
+
+    e = rcu_epoch.load();
+    while (c->rcu_head_ && e - c->rcu_head_->rcu_epoch_ >= 2) {
+        rcu_head* head = c->rcu_head_;
+        c->rcu_head_ = head->rcu_next_;
+        if (!c->rcu_head_) {
+            c->rcu_tailp_ = &c->rcu_head_;
+        }
+        --rcu_npending;
+        head->rcu_func_(head);
+    }
+}
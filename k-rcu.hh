@@ -0,0 +1,71 @@
+#ifndef CHICKADEE_K_RCU_HH
+#define CHICKADEE_K_RCU_HH
+#include <atomic>
+#include "k-lock.hh"
+
+// `k-rcu.hh` implements quiescent-state-based read-copy-update.
+//
+// Readers of RCU-protected data, such as `ptable`, bracket their
+// accesses with `rcu_read_lock()` and `rcu_read_unlock()`. They never
+// block and never write shared memory. A writer unlinks an object, then
+// calls `call_rcu()`; the callback runs once every CPU has passed
+// through a quiescent state, at which point no reader can still hold a
+// reference. CPUs report quiescent states from `cpustate::schedule()`
+// and from the idle loop, neither of which can run inside a read-side
+// critical section.
+
+struct rcu_head {
+    rcu_head* rcu_next_;
+    void (*rcu_func_)(rcu_head*);
+    unsigned long rcu_epoch_;
+};
+
+
+// rcu_read_lock(), rcu_read_unlock(irqs)
+//    Begin and end an RCU read-side critical section. Like a spinlock,
+//    a read-side section disables interrupts and counts towards
+//    `cpustate::spinlock_depth_`, so the CPU cannot schedule (and
+//    therefore cannot pass a quiescent state) until it ends.
+inline irqstate rcu_read_lock() {
+    irqstate s = irqstate::get();
+    cli();
+    adjust_this_cpu_spinlock_depth(1);
+    return s;
+}
+
+inline void rcu_read_unlock(irqstate& irqs) {
+    adjust_this_cpu_spinlock_depth(-1);
+    irqs.restore();
+}
+
+
+// rcu_dereference(p), rcu_assign_pointer(p, v)
+//    Read or publish an RCU-protected pointer.
+template <typename T>
+inline T* rcu_dereference(T* const& p) {
+    return __atomic_load_n(&p, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+inline void rcu_assign_pointer(T*& p, T* v) {
+    __atomic_store_n(&p, v, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+inline void rcu_assign_pointer(T*& p, std::nullptr_t) {
+    __atomic_store_n(&p, static_cast<T*>(nullptr), __ATOMIC_RELEASE);
+}
+
+
+// call_rcu(head, func)
+//    Arrange for `func(head)` to run on this CPU after a grace period:
+//    that is, after every CPU has passed through a quiescent state.
+void call_rcu(rcu_head* head, void (*func)(rcu_head*));
+
+// rcu_quiescent()
+//    Report that this CPU holds no RCU references, advance the global
+//    epoch if possible, and run this CPU's expired callbacks. Must be
+//    called with interrupts disabled and no spinlocks held.
+void rcu_quiescent();
+
+#endif
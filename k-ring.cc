@@ -0,0 +1,180 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-ring.cc
+//
+//    System call rings. `sys_ring_setup` maps a `sysring` page shared by
+//    a process and the kernel (see `lib.hh`); the process queues system
+//    calls there and runs a whole batch with one `sys_ring_enter`. If
+//    the ring was set up with `SYSRING_POLL`, the `ringd` kernel task
+//    also drains it about every tick, so queued calls run without any
+//    kernel entry by the process.
+//
+//    Rings are drained with the owner's `vmlock_` held, whether by the
+//    owner or by `ringd`, so only system calls that run under `vmlock_`
+//    and cannot block are allowed: those marked `SYSF_RING` in
+//    `proc::syscall_table`. `ringd` try-locks `vmlock_` under RCU like
+//    the page deduplicator, which keeps the owner from exiting while its
+//    ring is drained.
+
+#define RING_INTERVAL           1       // ticks between `ringd` passes
+
+static_assert(sizeof(sysring) <= PAGESIZE, "sysring must fit in a page");
+
+static std::atomic<int> ring_npolled;   // # rings with `SYSRING_POLL`
+static wait_queue ring_wq;              // `ringd` sleeps here
+
+
+// proc::ring_drain(max)
+//    Run up to `max` system calls queued on this process's ring, stopping
+//    early if the completion queue is full. `vmlock_` must be held.
+//    Returns the number run. The process can scribble on the ring at any
+//    time, so the kernel keeps its own copies of the indexes it owns and
+//    copies each entry before using it.
+
+int proc::ring_drain(unsigned max) {
+    sysring* ring = ring_;
+    uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    if (tail - ring_sq_head_ > SYSRING_NSQE) {
+        return E_INVAL;
+    }
+
+    unsigned n = 0;
+    while (n != max && ring_sq_head_ != tail) {
+        uint32_t cq_head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+        if (ring_cq_tail_ - cq_head >= SYSRING_NCQE) {
+            break;
+        }
+        sysring_sqe sqe = ring->sq[ring_sq_head_ % SYSRING_NSQE];
+
+        uintptr_t r = E_INVAL;
+        if (sqe.op < NSYSCALL
+            && (syscall_table[sqe.op].flags_ & SYSF_RING)) {
+            regstate regs;
+            regs.reg_rax = sqe.op;
+            regs.reg_rdi = sqe.args[0];
+            regs.reg_rsi = sqe.args[1];
+            regs.reg_rdx = sqe.args[2];
+            regs.reg_r10 = sqe.args[3];
+            regs.reg_r8 = sqe.args[4];
+            regs.reg_r9 = sqe.args[5];
+            r = syscall_table[sqe.op].fn_(this, &regs);
+            kstat_add(kstat_ring_ops);
+        }
+
+        sysring_cqe* cqe = &ring->cq[ring_cq_tail_ % SYSRING_NCQE];
+        cqe->user_data = sqe.user_data;
+        cqe->result = r;
+        ++ring_sq_head_;
+        ++ring_cq_tail_;
+        __atomic_store_n(&ring->sq_head, ring_sq_head_, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->cq_tail, ring_cq_tail_, __ATOMIC_RELEASE);
+        ++n;
+    }
+    return n;
+}
+
+
+// proc::syscall_ring_setup(flags)
+//    Create this process's ring as a shared anonymous mapping. The kernel
+//    keeps its own reference to the ring page, so unmapping it cannot
+//    free the page out from under `ring_drain`. Returns its address.
+
+uintptr_t proc::syscall_ring_setup(int flags) {
+    if (ring_ || (flags & ~SYSRING_POLL)) {
+        return E_INVAL;
+    }
+    uintptr_t addr = syscall_mmap(0, PAGESIZE, PTE_P | PTE_W | PTE_U,
+                                  MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+    if (intptr_t(addr) < 0) {
+        return addr;
+    }
+    vmiter it(this, addr);
+    kincref(it.ka<x86_64_page*>());
+    ring_ = it.ka<sysring*>();
+    ring_->flags = flags;
+    ring_sq_head_ = ring_cq_tail_ = 0;
+    if (flags & SYSRING_POLL) {
+        ring_poll_ = true;
+        ++ring_npolled;
+        ring_wq.wake_all();
+    }
+    return addr;
+}
+
+
+// proc::syscall_ring_enter(n)
+//    Run up to `n` queued system calls, or all of them if `n == 0`.
+
+int proc::syscall_ring_enter(unsigned n) {
+    if (!ring_) {
+        return E_INVAL;
+    }
+    return ring_drain(n ? n : SYSRING_NSQE);
+}
+
+
+// proc::ring_free()
+//    Drop the kernel's reference to this exiting process's ring.
+//    `vmlock_` must be held.
+
+void proc::ring_free() {
+    if (!ring_) {
+        return;
+    }
+    if (ring_poll_) {
+        --ring_npolled;
+        ring_poll_ = false;
+    }
+    kfree(reinterpret_cast<x86_64_page*>(ring_));
+    ring_ = nullptr;
+}
+
+
+// ringd(self)
+//    The ring polling kernel task. Sleeps without a deadline while no
+//    ring needs polling.
+
+static void ringd(proc* self) {
+    while (1) {
+        for (pid_t pid = 1; ring_npolled != 0 && pid != NPROC; ++pid) {
+            auto irqs = rcu_read_lock();
+            proc* p = ptable_lookup(pid);
+            bool locked = p && p->vmlock_.try_lock();
+            rcu_read_unlock(irqs);
+            if (!locked) {
+                continue;
+            }
+            if (p->ring_poll_) {
+                p->ring_drain(SYSRING_NSQE);
+            }
+            p->vmlock_.unlock();
+        }
+
+        // `ring_npolled` is checked with `ring_wq.lock_` held, so a
+        // `sys_ring_setup` that raises it cannot miss waking us
+        auto irqs = ring_wq.lock_.lock();
+        self->wq_deadline_ = ring_npolled ? ktime.ticks() + RING_INTERVAL : 0;
+        ring_wq.block(self, irqs);
+        self->wq_deadline_ = 0;
+    }
+}
+
+
+void ring_start() {
+    proc* p = reinterpret_cast<proc*>(kallocpage());
+    assert(p);
+    p->init_kernel(-1, ringd);
+    int cpu = ncpu - 1;
+    p->cpu_ = cpu;
+    auto irqs = cpus[cpu].runq_lock_.lock();
+    cpus[cpu].enqueue(p);
+    cpus[cpu].runq_lock_.unlock(irqs);
+}
+
+
+void ring_expire(unsigned long now) {
+    if (!ring_wq.empty()) {
+        ring_wq.expire(now, 0);
+    }
+}
@@ -0,0 +1,253 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-shm.cc
+//
+//    Shared memory segments. A segment is an array of physical pages,
+//    each holding one reference for the segment and one for every
+//    mapping. A segment's own reference count counts the processes
+//    attached to it (`proc::shm_`); the segment and its page references
+//    are freed when that count reaches zero. Segment pages are mapped
+//    with PTE_SHARED, so `fork` shares them rather than marking them
+//    copy-on-write, and each mapping has a VMA_SHARED VMA.
+
+#define NSHM                    16
+#define SHM_MAXPAGES            (PAGESIZE / sizeof(x86_64_page*))
+
+struct shm_segment {
+    int refcount_;              // 0 means unused
+    size_t npages_;
+    x86_64_page** pages_;       // page of page pointers
+};
+
+static spinlock shm_lock;
+static shm_segment shm_table[NSHM];
+
+
+// shm_put(id)
+//    Drop a reference to segment `id`, freeing it if that was the last.
+//    `shm_lock` must not be held.
+
+static void shm_put(int id) {
+    shm_segment* seg = &shm_table[id];
+    auto irqs = shm_lock.lock();
+    assert(seg->refcount_ > 0);
+    bool last = --seg->refcount_ == 0;
+    x86_64_page** pages = seg->pages_;
+    size_t npages = seg->npages_;
+    if (last) {
+        seg->pages_ = nullptr;
+    }
+    shm_lock.unlock(irqs);
+
+    if (last) {
+        kfree_pages(pages, npages);
+        kfree(reinterpret_cast<x86_64_page*>(pages));
+    }
+}
+
+
+// find_attachment(p, addr, id)
+//    Return `p`'s attachment with address `addr` and segment `id` (any
+//    segment if `id < 0`), or nullptr.
+
+static shm_attachment* find_attachment(proc* p, uintptr_t addr, int id) {
+    for (int i = 0; i != NSHMATTACH; ++i) {
+        if (p->shm_[i].id_ >= 0
+            && p->shm_[i].addr_ == addr
+            && (id < 0 || p->shm_[i].id_ == id)) {
+            return &p->shm_[i];
+        }
+    }
+    return nullptr;
+}
+
+
+int shm_create(proc* p, size_t size) {
+    if (size == 0 || size > SHM_MAXPAGES * PAGESIZE) {
+        return E_INVAL;
+    }
+    // a process may hold at most one created-but-unmapped segment
+    if (find_attachment(p, 0, -1)) {
+        return E_AGAIN;
+    }
+    shm_attachment* att = nullptr;
+    for (int i = 0; !att && i != NSHMATTACH; ++i) {
+        if (p->shm_[i].id_ < 0) {
+            att = &p->shm_[i];
+        }
+    }
+    if (!att) {
+        return E_NOMEM;
+    }
+
+    size_t npages = ROUNDUP(size, PAGESIZE) / PAGESIZE;
+    auto pages = reinterpret_cast<x86_64_page**>(kallocpage());
+    if (!pages) {
+        return E_NOMEM;
+    }
+    memset(pages, 0, PAGESIZE);
+    for (size_t i = 0; i != npages; ++i) {
+        pages[i] = kallocpage();
+        if (!pages[i]) {
+            kfree_pages(pages, i);
+            kfree(reinterpret_cast<x86_64_page*>(pages));
+            return E_NOMEM;
+        }
+        memset(pages[i], 0, PAGESIZE);
+    }
+
+    auto irqs = shm_lock.lock();
+    int id = 0;
+    while (id != NSHM && shm_table[id].refcount_ != 0) {
+        ++id;
+    }
+    if (id != NSHM) {
+        shm_table[id].refcount_ = 1;
+        shm_table[id].npages_ = npages;
+        shm_table[id].pages_ = pages;
+    }
+    shm_lock.unlock(irqs);
+
+    if (id == NSHM) {
+        kfree_pages(pages, npages);
+        kfree(reinterpret_cast<x86_64_page*>(pages));
+        return E_NOMEM;
+    }
+    att->addr_ = 0;
+    att->id_ = id;
+    return id;
+}
+
+
+int shm_map(proc* p, int id, uintptr_t addr, int perm) {
+    if (id < 0 || id >= NSHM
+        || addr == 0
+        || (addr & PAGEOFFMASK)
+        || (perm & ~(PTE_P | PTE_W | PTE_U))
+        || (perm & (PTE_P | PTE_U)) != (PTE_P | PTE_U)) {
+        return E_INVAL;
+    }
+
+    // find an attachment slot: the creator's unmapped one, or a new one
+    shm_attachment* att = find_attachment(p, 0, id);
+    for (int i = 0; !att && i != NSHMATTACH; ++i) {
+        if (p->shm_[i].id_ < 0) {
+            att = &p->shm_[i];
+        }
+    }
+    if (!att) {
+        return E_NOMEM;
+    }
+    bool pending = att->id_ == id;
+    assert(att->addr_ == 0);
+
+    auto irqs = shm_lock.lock();
+    shm_segment* seg = &shm_table[id];
+    if (seg->refcount_ == 0) {
+        shm_lock.unlock(irqs);
+        return E_INVAL;
+    }
+    if (!pending) {
+        ++seg->refcount_;
+    }
+    size_t npages = seg->npages_;
+    x86_64_page** pages = seg->pages_;
+    shm_lock.unlock(irqs);
+    att->id_ = id;
+
+    // the range must have no pages; VMAs there are replaced
+    int r = 0;
+    uintptr_t end = addr + npages * PAGESIZE;
+    if (end > VA_USERMAX + 1) {
+        r = E_INVAL;
+    }
+    for (vmiter it(p, addr); r == 0 && it.va() < end; it += PAGESIZE) {
+        if (it.present()) {
+            r = E_INVAL;
+        }
+    }
+    if (r == 0
+        && (p->remove_vmas(addr, end) < 0
+            || p->add_vma(addr, end, perm, VMA_SHARED) < 0)) {
+        r = E_NOMEM;
+    }
+    for (size_t i = 0; r == 0 && i != npages; ++i) {
+        if (vmiter(p, addr + i * PAGESIZE).map(ka2pa(pages[i]),
+                                               perm | PTE_SHARED) < 0) {
+            // unmap the pages mapped so far, dropping their references
+            tlb_batch tlb(p);
+            vmiter(p, addr).unmap_range(i, tlb);
+            p->remove_vmas(addr, end);
+            r = E_NOMEM;
+        } else {
+            kincref(pages[i]);
+        }
+    }
+
+    if (r < 0) {
+        // keep a creator's unmapped reference; drop any other
+        if (!pending) {
+            att->id_ = -1;
+            shm_put(id);
+        }
+        return r;
+    }
+    att->addr_ = addr;
+    return 0;
+}
+
+
+int shm_unmap(proc* p, uintptr_t addr) {
+    shm_attachment* att = addr ? find_attachment(p, addr, -1) : nullptr;
+    if (!att) {
+        return E_INVAL;
+    }
+    int id = att->id_;
+    att->id_ = -1;
+    att->addr_ = 0;
+
+    {
+        size_t npages = shm_table[id].npages_;
+        tlb_batch tlb(p);
+        int r = vmiter(p, addr).unmap_range(npages, tlb);
+        assert(r == 0);
+        r = p->remove_vmas(addr, addr + npages * PAGESIZE);
+        assert(r == 0);
+    }
+    shm_put(id);
+    return 0;
+}
+
+
+void shm_cancel(proc* p, int id) {
+    shm_attachment* att = find_attachment(p, 0, id);
+    assert(att);
+    att->id_ = -1;
+    shm_put(id);
+}
+
+
+void shm_fork(proc* p, proc* child) {
+    auto irqs = shm_lock.lock();
+    for (int i = 0; i != NSHMATTACH; ++i) {
+        child->shm_[i] = p->shm_[i];
+        if (p->shm_[i].id_ >= 0 && p->shm_[i].addr_ != 0) {
+            ++shm_table[p->shm_[i].id_].refcount_;
+        } else {
+            child->shm_[i].id_ = -1;
+            child->shm_[i].addr_ = 0;
+        }
+    }
+    shm_lock.unlock(irqs);
+}
+
+
+void shm_exit(proc* p) {
+    for (int i = 0; i != NSHMATTACH; ++i) {
+        if (p->shm_[i].id_ >= 0) {
+            shm_put(p->shm_[i].id_);
+            p->shm_[i].id_ = -1;
+        }
+    }
+}
@@ -0,0 +1,195 @@
+#include "kernel.hh"
+#include "k-apic.hh"
+
+// k-tlb.cc
+//
+//    TLB shootdown. Each CPU has a small queue of invalidation requests,
+//    `cpustate::tlb_queue_`. A sender appends its ranges to the queue of
+//    every CPU that has the affected page table loaded, sends each one a
+//    single IRQ_TLBSHOOTDOWN interrupt, and waits until those CPUs'
+//    `tlb_done_` counters pass the tickets it took from `tlb_req_`.
+
+
+tlb_batch::tlb_batch(proc* p)
+    : p_(p), n_(0), npages_(0), full_(false), nfree_(0) {
+}
+
+tlb_batch::~tlb_batch() {
+    flush();
+}
+
+
+// tlb_batch::add(va, sz)
+//    Add the pages overlapping `[va, va + sz)` to the batch.
+
+void tlb_batch::add(uintptr_t va, size_t sz) {
+    uintptr_t start = ROUNDDOWN(va, PAGESIZE);
+    uintptr_t end = ROUNDUP(va + sz, PAGESIZE);
+    npages_ += (end - start) / PAGESIZE;
+    if (full_ || npages_ > full_threshold) {
+        full_ = true;
+    } else if (n_ > 0 && end_[n_ - 1] == start) {
+        // extend the previous range
+        end_[n_ - 1] = end;
+    } else if (n_ == max_ranges) {
+        full_ = true;
+    } else {
+        start_[n_] = start;
+        end_[n_] = end;
+        ++n_;
+    }
+}
+
+
+// tlb_batch::free_page(pg)
+//    Drop a reference to `pg` once the batch has been flushed. Every
+//    mapping of `pg` being invalidated must already have been `add`ed.
+
+void tlb_batch::free_page(x86_64_page* pg) {
+    if (nfree_ == max_free) {
+        flush();
+    }
+    free_[nfree_] = pg;
+    ++nfree_;
+}
+
+
+// invalidate_local(full, start, end)
+//    Invalidate `[start, end)` (or everything, if `full`) in the current
+//    address space on this CPU.
+
+static void invalidate_local(bool full, uintptr_t start, uintptr_t end) {
+    if (full) {
+        tlbflush();
+    } else {
+        for (uintptr_t va = start; va < end; va += PAGESIZE) {
+            invlpg(reinterpret_cast<void*>(va));
+        }
+    }
+}
+
+
+void tlb_batch::flush() {
+    if (n_ == 0 && !full_) {
+        // Every queued page's range was added before the page was, so
+        // the internal flush in `free_page` already invalidated it.
+        free_pages();
+        return;
+    }
+
+    irqstate irqs = irqstate::get();
+    cli();
+    cpustate* self = this_cpu();
+    unsigned selfmask = 1U << self->index_;
+    uintptr_t pt_pa = ka2pa(p_->pagetable_);
+
+    // invalidate on this CPU
+    bool local = (rcr3() & PTE_PAMASK) == pt_pa;
+    if (local && full_) {
+        invalidate_local(true, 0, 0);
+    } else if (local) {
+        for (unsigned i = 0; i != n_; ++i) {
+            invalidate_local(false, start_[i], end_[i]);
+        }
+    }
+
+    // drop `p_`'s PCIDs on CPUs where its page table is not loaded
+    // (that is every other CPU, for all we know; see `load_pagetable`)
+    for (int c = 0; c < ncpu; ++c) {
+        if (c != self->index_ || !local) {
+            __atomic_store_n(&p_->pcid_tag_[c], 0, __ATOMIC_SEQ_CST);
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // queue requests and interrupt CPUs with `p_` loaded
+    unsigned mask = p_->active_cpus_.load() & ~selfmask;
+    if (mask) {
+        uint64_t t0 = rdtsc();
+        unsigned long tickets[NCPU];
+        auto& lapic = lapicstate::get();
+        for (int c = 0; c < ncpu; ++c) {
+            if (!(mask & (1U << c))) {
+                continue;
+            }
+            cpustate* t = &cpus[c];
+            t->tlb_lock_.lock_noirq();
+            for (unsigned i = 0; i != n_ && !full_; ++i) {
+                if (t->tlb_nqueue_ == NTLBQUEUE) {
+                    t->tlb_flush_all_ = true;
+                    break;
+                }
+                t->tlb_queue_[t->tlb_nqueue_] = {pt_pa, start_[i], end_[i]};
+                ++t->tlb_nqueue_;
+            }
+            t->tlb_flush_all_ = t->tlb_flush_all_ || full_;
+            tickets[c] = ++t->tlb_req_;
+            t->tlb_lock_.unlock_noirq();
+            lapic.ipi(t->lapic_id_, INT_IRQ + IRQ_TLBSHOOTDOWN);
+        }
+
+        // wait for acknowledgements, serving requests sent to us so
+        // concurrent shootdowns cannot deadlock
+        for (int c = 0; c < ncpu; ++c) {
+            if (mask & (1U << c)) {
+                while (cpus[c].tlb_done_.load() < tickets[c]) {
+                    tlb_shootdown_handle();
+                    pause();
+                }
+                kstat_add(kstat_tlb_ipis);
+            }
+        }
+        kstat_add(kstat_tlb_shootdowns);
+        kstat_add(kstat_tlb_shootdown_cycles, rdtsc() - t0);
+    }
+
+    n_ = 0;
+    npages_ = 0;
+    full_ = false;
+    irqs.restore();
+    free_pages();
+}
+
+
+// tlb_batch::free_pages()
+//    Drop the references queued by `free_page`.
+
+void tlb_batch::free_pages() {
+    for (unsigned i = 0; i != nfree_; ++i) {
+        kfree(free_[i]);
+    }
+    nfree_ = 0;
+}
+
+
+void tlb_shootdown_handle() {
+    assert(is_cli());
+    cpustate* c = this_cpu();
+    if (c->tlb_done_.load(std::memory_order_relaxed) == c->tlb_req_.load()) {
+        return;
+    }
+
+    tlb_range q[NTLBQUEUE];
+    c->tlb_lock_.lock_noirq();
+    unsigned long req = c->tlb_req_.load(std::memory_order_relaxed);
+    unsigned n = c->tlb_nqueue_;
+    bool full = c->tlb_flush_all_;
+    memcpy(q, c->tlb_queue_, sizeof(tlb_range) * n);
+    c->tlb_nqueue_ = 0;
+    c->tlb_flush_all_ = false;
+    c->tlb_lock_.unlock_noirq();
+
+    // Requests for other address spaces need no work: their PCIDs were
+    // dropped, or (without PCIDs) loading them will flush the TLB.
+    uintptr_t pt_pa = rcr3() & PTE_PAMASK;
+    if (full) {
+        invalidate_local(true, 0, 0);
+    } else {
+        for (unsigned i = 0; i != n; ++i) {
+            if (q[i].pt_pa_ == pt_pa) {
+                invalidate_local(false, q[i].start_, q[i].end_);
+            }
+        }
+    }
+    c->tlb_done_.store(req);
+}
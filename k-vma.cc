@@ -0,0 +1,599 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-vma.cc
+//
+//    Virtual memory areas and the `mmap` family of system calls. A
+//    process's VMAs live in one page, `proc::vmas_`, as an array sorted
+//    by address, so finding the VMA for a faulting address is a binary
+//    search. VMAs never overlap; `munmap` and `mprotect` split them at
+//    the boundaries of their ranges. Only the owning process changes its
+//    VMAs.
+//
+//    Anonymous and file-backed VMAs are populated on demand by the page
+//    fault handler, which also maps pages ahead of sequential access
+//    (`proc::fault_around`). Shared anonymous mappings are shared memory
+//    segments (see `k-shm.cc`), whose pages are mapped eagerly.
+
+#define FAULT_AROUND_MAX        16U     // max pages mapped ahead of a fault
+
+
+// vma_index(vmas, n, va)
+//    Return the index of the first VMA in `vmas[0..n)` that ends after
+//    `va`, or `n` if there is none.
+
+static int vma_index(const vmarea* vmas, int n, uintptr_t va) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (vmas[mid].end_ <= va) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+// proc::find_vma(va)
+//    Return the VMA containing `va`, or nullptr.
+
+vmarea* proc::find_vma(uintptr_t va) {
+    int i = vma_index(vmas_, nvmas_, va);
+    if (i < nvmas_ && vmas_[i].start_ <= va) {
+        return &vmas_[i];
+    }
+    return nullptr;
+}
+
+
+// proc::add_vma(start, end, perm, flags, file, file_end)
+//    Add a VMA for user addresses `[start, end)`, which must be
+//    page-aligned. File-backed VMAs (`flags & VMA_FILE`) read file data
+//    starting at `file` up to address `file_end`, and zeroes after
+//    that. Returns 0 on success and -1 if the range overlaps another VMA
+//    or memory runs out.
+
+int proc::add_vma(uintptr_t start, uintptr_t end, int perm, int flags,
+                  const uint8_t* file, uintptr_t file_end) {
+    assert(start % PAGESIZE == 0 && end % PAGESIZE == 0 && start < end);
+    assert(end - 1 <= VA_USERMAX);
+    int i = vma_index(vmas_, nvmas_, start);
+    if ((i < nvmas_ && vmas_[i].start_ < end)
+        || size_t(nvmas_) == NVMAS) {
+        return -1;
+    }
+    if (!vmas_) {
+        vmas_ = reinterpret_cast<vmarea*>(kallocpage());
+        if (!vmas_) {
+            return -1;
+        }
+    }
+    memmove(&vmas_[i + 1], &vmas_[i], sizeof(vmarea) * (nvmas_ - i));
+    vmas_[i] = {start, end, perm, flags, file, file_end};
+    ++nvmas_;
+    return 0;
+}
+
+
+// proc::split_vma(va)
+//    Ensure no VMA spans page-aligned address `va`, splitting the one
+//    that does in two. Returns 0 on success and E_NOMEM if the VMA
+//    table is full.
+
+int proc::split_vma(uintptr_t va) {
+    int i = vma_index(vmas_, nvmas_, va);
+    if (i == nvmas_ || vmas_[i].start_ >= va) {
+        return 0;
+    }
+    if (size_t(nvmas_) == NVMAS) {
+        return E_NOMEM;
+    }
+    memmove(&vmas_[i + 1], &vmas_[i], sizeof(vmarea) * (nvmas_ - i));
+    ++nvmas_;
+    vmas_[i].end_ = va;
+    vmas_[i + 1].start_ = va;
+    if (vmas_[i + 1].flags_ & VMA_FILE) {
+        vmas_[i + 1].file_ += va - vmas_[i].start_;
+    }
+    return 0;
+}
+
+
+// proc::remove_vmas(start, end)
+//    Remove VMAs in `[start, end)`, trimming those that overlap its
+//    ends. Mappings are not changed. Returns 0 or E_NOMEM.
+
+int proc::remove_vmas(uintptr_t start, uintptr_t end) {
+    if (split_vma(start) < 0 || split_vma(end) < 0) {
+        return E_NOMEM;
+    }
+    int i = vma_index(vmas_, nvmas_, start);
+    int j = vma_index(vmas_, nvmas_, end);
+    memmove(&vmas_[i], &vmas_[j], sizeof(vmarea) * (nvmas_ - j));
+    nvmas_ -= j - i;
+    return 0;
+}
+
+
+// proc::copy_vmas(child)
+//    Give `child`, which has no VMAs, a copy of this process's VMAs.
+//    Returns 0 or E_NOMEM.
+
+int proc::copy_vmas(proc* child) {
+    assert(!child->vmas_);
+    if (vmas_) {
+        child->vmas_ = reinterpret_cast<vmarea*>(kallocpage());
+        if (!child->vmas_) {
+            return E_NOMEM;
+        }
+        memcpy(child->vmas_, vmas_, sizeof(vmarea) * nvmas_);
+        child->nvmas_ = nvmas_;
+    }
+    return 0;
+}
+
+
+// proc::free_vmas()
+//    Remove all VMAs and free the VMA page.
+
+void proc::free_vmas() {
+    kfree(reinterpret_cast<x86_64_page*>(vmas_));
+    vmas_ = nullptr;
+    nvmas_ = 0;
+}
+
+
+// proc::fault_in(vma, va)
+//    Map the page containing `va`, which must not be present, as
+//    described by `vma`. File pages that lie entirely within page-aligned
+//    kernel-image data, such as flatfs files, are mapped directly onto
+//    that data: read-only, or copy-on-write if `vma` is writable. Other
+//    pages are allocated and filled with zeroes and any file data.
+//    Returns 0 on success and -1 on failure.
+
+int proc::fault_in(const vmarea* vma, uintptr_t va) {
+    va = ROUNDDOWN(va, PAGESIZE);
+    assert(va >= vma->start_ && va < vma->end_);
+    // shared memory segments are always mapped
+    if (vma->flags_ & VMA_SHARED) {
+        return -1;
+    }
+
+    vmiter it(this, va);
+    const uint8_t* src = nullptr;
+    size_t srcsz = 0;
+    if ((vma->flags_ & VMA_FILE) && va < vma->file_end_) {
+        src = vma->file_ + (va - vma->start_);
+        srcsz = MIN(vma->file_end_ - va, size_t(PAGESIZE));
+        if (srcsz == PAGESIZE
+            && is_ktext(src)
+            && ((uintptr_t) src & PAGEOFFMASK) == 0) {
+            int perm = vma->perm_;
+            if (perm & PTE_W) {
+                perm = (perm & ~PTE_W) | PTE_COW;
+            }
+            return it.map(ktext2pa(src), perm);
+        }
+    }
+
+    x86_64_page* pg = kallocpage();
+    if (!pg) {
+        return -1;
+    }
+    memset(pg, 0, PAGESIZE);
+    if (src) {
+        memcpy(pg, src, srcsz);
+    }
+    if (it.map(ka2pa(pg), vma->perm_) < 0) {
+        kfree(pg);
+        return -1;
+    }
+    return 0;
+}
+
+
+// proc::fault_around(vma, va)
+//    Map pages of `vma` following `va`, which just faulted, before they
+//    are touched. The window starts at 0 pages and doubles, up to
+//    FAULT_AROUND_MAX, while each fault lands where the previous window
+//    ended; any other fault closes it. VMA_SEQUENTIAL VMAs always use the
+//    largest window. Mapping stops at the first present page.
+
+void proc::fault_around(const vmarea* vma, uintptr_t va) {
+    va = ROUNDDOWN(va, PAGESIZE);
+    if (vma->flags_ & VMA_SEQUENTIAL) {
+        fault_window_ = FAULT_AROUND_MAX;
+    } else if (va == fault_next_) {
+        unsigned window = fault_window_ ? 2 * fault_window_ : 1;
+        fault_window_ = MIN(window, FAULT_AROUND_MAX);
+    } else {
+        fault_window_ = 0;
+    }
+
+    uintptr_t a = va + PAGESIZE;
+    unsigned n = 0;
+    for (vmiter it(this, a);
+         n != fault_window_ && a < vma->end_ && !it.present();
+         ++n, a += PAGESIZE, it += PAGESIZE) {
+        if (fault_in(vma, a) < 0) {
+            break;
+        }
+    }
+    fault_next_ = a;
+    if (n) {
+        kstat_add(kstat_faults_avoided, n);
+    }
+}
+
+
+// copy_user_string(p, dst, sz, addr)
+//    Copy the NUL-terminated string at user address `addr` in `p` into
+//    `dst`, which has room for `sz` characters. Pages not yet touched,
+//    such as program text, are faulted in as a user read would. Returns
+//    0, E_FAULT if the string is not readable, or E_INVAL if it is too
+//    long.
+
+static int copy_user_string(proc* p, char* dst, size_t sz, uintptr_t addr) {
+    vmiter it(p, addr);
+    for (size_t i = 0; i != sz; ++i, it += 1) {
+        if (!it.user()
+            && (it.present()
+                || it.va() > VA_LOWMAX
+                || !p->handle_page_fault(it.va(), PFERR_USER))) {
+            return E_FAULT;
+        }
+        it.find(it.va());
+        if (!it.user()) {
+            return E_FAULT;
+        }
+        dst[i] = *it.ka<const char*>();
+        if (dst[i] == '\0') {
+            return 0;
+        }
+    }
+    return E_INVAL;
+}
+
+
+// proc::fault_in_write(addr)
+//    Make user address `addr` writable as a user write would, by
+//    faulting in demand-zero and copy-on-write pages. A file page may
+//    take two faults: one to map it copy-on-write and one to copy it.
+//    Returns true if `addr` is now writable.
+
+bool proc::fault_in_write(uintptr_t addr) {
+    vmiter it(this, addr);
+    for (int tries = 0; !(it.user() && it.writable()); ++tries) {
+        if (tries == 2
+            || addr > VA_LOWMAX
+            || !handle_page_fault(addr, PFERR_USER | PFERR_WRITE
+                                  | (it.present() ? PFERR_PRESENT : 0))) {
+            return false;
+        }
+        it.find(addr);
+    }
+    return true;
+}
+
+
+// proc::copy_to_user(addr, src, n)
+//    Copy `n` bytes from `src` to user address `addr`. Returns 0 or
+//    E_FAULT.
+
+int proc::copy_to_user(uintptr_t addr, const void* src, size_t n) {
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(src);
+    while (n != 0) {
+        if (!fault_in_write(addr)) {
+            return E_FAULT;
+        }
+        size_t sz = MIN(n, PAGESIZE - (addr & PAGEOFFMASK));
+        memcpy(vmiter(this, addr).ka<uint8_t*>(), s, sz);
+        addr += sz;
+        s += sz;
+        n -= sz;
+    }
+    return 0;
+}
+
+
+// mmap_address(vmas, n, hint, len)
+//    Return a page-aligned address where `len` bytes of user address
+//    space are free of VMAs: `hint` if possible, otherwise the lowest
+//    such address at or above MEMSIZE_VIRTUAL, which keeps mappings
+//    clear of the program image, heap, and stack. Returns 0 if there is
+//    none.
+
+static uintptr_t mmap_address(const vmarea* vmas, int n, uintptr_t hint,
+                              size_t len) {
+    if (hint && hint <= VA_USERMAX + 1 - len) {
+        int i = vma_index(vmas, n, hint);
+        if (i == n || vmas[i].start_ >= hint + len) {
+            return hint;
+        }
+    }
+    uintptr_t addr = MEMSIZE_VIRTUAL;
+    for (int i = vma_index(vmas, n, addr);
+         i < n && vmas[i].start_ < addr + len;
+         ++i) {
+        addr = vmas[i].end_;
+    }
+    return addr <= VA_USERMAX + 1 - len ? addr : 0;
+}
+
+
+// valid_range(addr, len)
+//    Return true iff `[addr, addr + len)` is a nonempty user address range
+//    starting on a page boundary.
+
+static bool valid_range(uintptr_t addr, size_t len) {
+    return (addr & PAGEOFFMASK) == 0
+        && len != 0
+        && addr <= VA_USERMAX
+        && len <= VA_USERMAX + 1 - addr;
+}
+
+// valid_perm(perm)
+//    Return true iff `perm` is a valid user mapping permission.
+
+static bool valid_perm(int perm) {
+    return (perm & ~(PTE_P | PTE_W | PTE_U)) == 0
+        && (perm & (PTE_P | PTE_U)) == (PTE_P | PTE_U);
+}
+
+
+// proc::syscall_mmap(addr, len, perm, flags, name_addr, offset)
+//    Map `len` bytes with permissions `perm`. See `sys_mmap` in
+//    `p-lib.hh`.
+
+uintptr_t proc::syscall_mmap(uintptr_t addr, size_t len, int perm, int flags,
+                             uintptr_t name_addr, size_t offset) {
+    if ((addr & PAGEOFFMASK)
+        || len == 0
+        || len > VA_USERMAX
+        || !valid_perm(perm)
+        || (flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED))
+        || !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) {
+        return E_INVAL;
+    }
+    len = ROUNDUP(len, PAGESIZE);
+
+    const uint8_t* file = nullptr;
+    size_t filesz = 0;
+    if (!(flags & MAP_ANONYMOUS)) {
+        char name[32];
+        int r = copy_user_string(this, name, sizeof(name), name_addr);
+        if (r < 0) {
+            return r;
+        }
+        file = flatfs_find(name, &filesz);
+        if (!file
+            || (offset & PAGEOFFMASK)
+            || offset > filesz
+            // flatfs is read-only, so writes cannot be shared
+            || ((flags & MAP_SHARED) && (perm & PTE_W))) {
+            return E_INVAL;
+        }
+    }
+
+    if (flags & MAP_FIXED) {
+        int r = valid_range(addr, len) ? syscall_munmap(addr, len) : E_INVAL;
+        if (r < 0) {
+            return r;
+        }
+    } else {
+        addr = mmap_address(vmas_, nvmas_, addr, len);
+        if (!addr) {
+            return E_NOMEM;
+        }
+    }
+
+    if (file) {
+        if (add_vma(addr, addr + len, perm, VMA_FILE, file + offset,
+                    addr + (filesz - offset)) < 0) {
+            return E_NOMEM;
+        }
+    } else if (flags & MAP_SHARED) {
+        int id = shm_create(this, len);
+        if (id < 0) {
+            return id;
+        }
+        int r = shm_map(this, id, addr, perm);
+        if (r < 0) {
+            shm_cancel(this, id);
+            return r;
+        }
+    } else if (add_vma(addr, addr + len, perm) < 0) {
+        return E_NOMEM;
+    }
+    return addr;
+}
+
+
+// proc::syscall_munmap(addr, len)
+//    Unmap `[addr, addr + len)`, dropping its VMAs and pages. Shared
+//    memory mappings can only be unmapped whole.
+
+int proc::syscall_munmap(uintptr_t addr, size_t len) {
+    if (!valid_range(addr, len)) {
+        return E_INVAL;
+    }
+    uintptr_t end = ROUNDUP(addr + len, PAGESIZE);
+    for (int i = vma_index(vmas_, nvmas_, addr);
+         i < nvmas_ && vmas_[i].start_ < end;
+         ++i) {
+        if ((vmas_[i].flags_ & VMA_SHARED)
+            && (vmas_[i].start_ < addr || vmas_[i].end_ > end)) {
+            return E_INVAL;
+        }
+    }
+    if (split_vma(addr) < 0 || split_vma(end) < 0) {
+        return E_NOMEM;
+    }
+
+    // `shm_unmap` removes the segment's VMA
+    int i = vma_index(vmas_, nvmas_, addr);
+    while (i < nvmas_ && vmas_[i].start_ < end) {
+        if (vmas_[i].flags_ & VMA_SHARED) {
+            int r = shm_unmap(this, vmas_[i].start_);
+            assert(r == 0);
+        } else {
+            ++i;
+        }
+    }
+    int r = remove_vmas(addr, end);
+    assert(r == 0);
+
+    tlb_batch tlb(this);
+    return vmiter(this, addr).unmap_range((end - addr) / PAGESIZE, tlb);
+}
+
+
+// proc::check_range(addr, end)
+//    Prepare page-aligned range `[addr, end)` for a change to its VMAs:
+//    it must be covered by VMAs, and shared memory VMAs must lie
+//    entirely inside it. Splits VMAs at `addr` and `end`. Returns 0,
+//    E_NOMEM if part of the range is not mapped or the VMA table is full,
+//    or E_INVAL.
+
+int proc::check_range(uintptr_t addr, uintptr_t end) {
+    uintptr_t covered = addr;
+    for (int i = vma_index(vmas_, nvmas_, addr);
+         i < nvmas_ && vmas_[i].start_ <= covered && covered < end;
+         ++i) {
+        if ((vmas_[i].flags_ & VMA_SHARED)
+            && (vmas_[i].start_ < addr || vmas_[i].end_ > end)) {
+            return E_INVAL;
+        }
+        covered = vmas_[i].end_;
+    }
+    if (covered < end) {
+        return E_NOMEM;
+    }
+    if (split_vma(addr) < 0 || split_vma(end) < 0) {
+        return E_NOMEM;
+    }
+    return 0;
+}
+
+
+// proc::syscall_mprotect(addr, len, perm)
+//    Change the permissions of `[addr, addr + len)`, which must be
+//    covered by VMAs, to `perm`. Shared memory mappings can only be
+//    changed whole.
+
+int proc::syscall_mprotect(uintptr_t addr, size_t len, int perm) {
+    if (!valid_range(addr, len) || !valid_perm(perm)) {
+        return E_INVAL;
+    }
+    uintptr_t end = ROUNDUP(addr + len, PAGESIZE);
+    int r = check_range(addr, end);
+    if (r < 0) {
+        return r;
+    }
+
+    tlb_batch tlb(this);
+    for (int i = vma_index(vmas_, nvmas_, addr);
+         i < nvmas_ && vmas_[i].start_ < end;
+         ++i) {
+        vmarea* vma = &vmas_[i];
+        if (vma->perm_ == perm) {
+            continue;
+        }
+        vma->perm_ = perm;
+        int pteperm = perm;
+        if (vma->flags_ & VMA_SHARED) {
+            pteperm |= PTE_SHARED;
+        } else if (perm & PTE_W) {
+            // Private pages may be shared with other processes or with
+            // the kernel image. Map them copy-on-write; the fault
+            // handler takes over pages with no other references.
+            pteperm = (perm & ~PTE_W) | PTE_COW;
+        }
+        r = vmiter(this, vma->start_)
+            .protect_range((vma->end_ - vma->start_) / PAGESIZE, pteperm, &tlb);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+
+// proc::syscall_madvise(addr, len, advice)
+//    Apply `advice` to `[addr, addr + len)`. MADV_NORMAL and
+//    MADV_SEQUENTIAL set the fault-around policy of the range's VMAs,
+//    which must cover it. MADV_WILLNEED maps the range's missing pages
+//    now, as far as memory allows; MADV_DONTNEED unmaps its pages. Both
+//    leave shared memory alone.
+
+int proc::syscall_madvise(uintptr_t addr, size_t len, int advice) {
+    if (!valid_range(addr, len)) {
+        return E_INVAL;
+    }
+    uintptr_t end = ROUNDUP(addr + len, PAGESIZE);
+    int i = vma_index(vmas_, nvmas_, addr);
+
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_SEQUENTIAL: {
+        int r = check_range(addr, end);
+        if (r < 0) {
+            return r;
+        }
+        for (i = vma_index(vmas_, nvmas_, addr);
+             i < nvmas_ && vmas_[i].start_ < end;
+             ++i) {
+            if (advice == MADV_SEQUENTIAL) {
+                vmas_[i].flags_ |= VMA_SEQUENTIAL;
+            } else {
+                vmas_[i].flags_ &= ~VMA_SEQUENTIAL;
+            }
+        }
+        return 0;
+    }
+
+    case MADV_WILLNEED: {
+        unsigned n = 0;
+        for (; i < nvmas_ && vmas_[i].start_ < end; ++i) {
+            if (vmas_[i].flags_ & VMA_SHARED) {
+                continue;
+            }
+            uintptr_t last = MIN(vmas_[i].end_, end);
+            for (vmiter it(this, MAX(vmas_[i].start_, addr));
+                 it.va() < last;
+                 it += PAGESIZE) {
+                if (!it.present()) {
+                    if (fault_in(&vmas_[i], it.va()) < 0) {
+                        break;
+                    }
+                    ++n;
+                }
+            }
+        }
+        kstat_add(kstat_faults_avoided, n);
+        return 0;
+    }
+
+    case MADV_DONTNEED: {
+        tlb_batch tlb(this);
+        for (; i < nvmas_ && vmas_[i].start_ < end; ++i) {
+            if (vmas_[i].flags_ & VMA_SHARED) {
+                continue;
+            }
+            uintptr_t first = MAX(vmas_[i].start_, addr);
+            uintptr_t last = MIN(vmas_[i].end_, end);
+            int r = vmiter(this, first)
+                .unmap_range((last - first) / PAGESIZE, tlb);
+            if (r < 0) {
+                return r;
+            }
+        }
+        return 0;
+    }
+
+    default:
+        return E_INVAL;
+    }
+}
@@ -2,7 +2,8 @@
 
 void vmiter::down() {
     while (level_ > 0 && (*pep_ & (PTE_P | PTE_PS)) == PTE_P) {
-        perm_ &= *pep_;
+        // only P, W, and U are inherited from upper levels
+        perm_ &= *pep_ | ~(PTE_P | PTE_W | PTE_U);
         --level_;
         uintptr_t pa = *pep_ & PTE_PAMASK;
         x86_64_pagetable* pt = pa2ka<x86_64_pagetable*>(pa);
@@ -32,16 +33,36 @@ void vmiter::next() {
 }
 
 int vmiter::map(uintptr_t pa, int perm) {
-    assert(!(va_ & PAGEOFFMASK));
+    return map(pa, perm, 0);
+}
+
+int vmiter::map(uintptr_t pa, int perm, int level) {
+    assert(level >= 0 && level <= 2);
+    assert(!(va_ & pageoffmask(level)));
     if (perm & PTE_P) {
         assert((pa & PTE_PAMASK) == pa);
+        assert(!(pa & pageoffmask(level)));
     } else {
         assert(!(pa & PTE_P));
     }
-    assert(!((perm ^ perm_) & (PTE_P | PTE_W | PTE_U)));
+    assert(!(perm & PTE_PS));
+    // upper levels must allow at least `perm`
+    assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
+    if (level == 2 && !(cpuid(0x80000001).edx & (1U << 26))) {
+        return -1;
+    }
 
-    while (level_ > 0 && perm) {
-        assert(!(*pep_ & PTE_P));
+    while (level_ > level) {
+        if (*pep_ & PTE_P) {
+            // a larger page covers va
+            if (split() < 0) {
+                return -1;
+            }
+            continue;
+        } else if (!perm) {
+            // nothing to unmap
+            return 0;
+        }
         x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
             (kallocpage());
         if (!pt) {
@@ -52,8 +73,166 @@ int vmiter::map(uintptr_t pa, int perm) {
         down();
     }
 
-    if (level_ == 0) {
-        *pep_ = pa | perm;
+    // a page table page must not be replaced by a leaf
+    assert(level_ == level);
+    if (level > 0 && (perm & PTE_P)) {
+        perm |= PTE_PS;
+    }
+    *pep_ = pa | perm;
+    return 0;
+}
+
+int vmiter::split() {
+    assert(level_ > 0 && (*pep_ & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS));
+    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
+        (kallocpage());
+    if (!pt) {
+        return -1;
+    }
+    uint64_t e = *pep_;
+    uintptr_t pa = e & PTE_PS_PAMASK & ~pageoffmask(level_);
+    // bit 12 is the PAT bit in large entries; `PTE_PS` means PAT at level 0
+    uint64_t flags = e & ~(PTE_PS_PAMASK | 0x1000UL | PTE_PS);
+    if (level_ > 1) {
+        flags |= PTE_PS;
+    }
+    uintptr_t sz = pageoffmask(level_ - 1) + 1;
+    for (int i = 0; i != 512; ++i) {
+        pt->entry[i] = (pa + i * sz) | flags;
+    }
+    *pep_ = ka2pa(pt) | PTE_P | PTE_W | PTE_U;
+    down();
+    return 0;
+}
+
+bool vmiter::try_promote() {
+    real_find(va_ & ~pageoffmask(1));
+    if (level_ != 0) {
+        return false;
+    }
+    // `pep_` points at entry 0 of the level-0 page table page
+    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>
+        (reinterpret_cast<uintptr_t>(pep_) & ~PAGEOFFMASK);
+    uint64_t e0 = pt->entry[0];
+    uintptr_t pa = e0 & PTE_PAMASK;
+    uint64_t ignored = PTE_A | PTE_D;
+    uint64_t flags = e0 & ~PTE_PAMASK & ~ignored;
+    uint64_t ad = 0;
+    if (!(e0 & PTE_P) || (pa & pageoffmask(1)) || (e0 & PTE_PS)) {
+        return false;
+    }
+    for (int i = 0; i != 512; ++i) {
+        uint64_t e = pt->entry[i];
+        if ((e & ~ignored) != ((pa + i * PAGESIZE) | flags)) {
+            return false;
+        }
+        ad |= e & ignored;
+    }
+
+    // find the level-1 entry and replace it
+    uintptr_t va = va_;
+    level_ = 3;
+    pep_ = &pt_->entry[pageindex(va, level_)];
+    perm_ = initial_perm;
+    while (level_ > 1) {
+        perm_ &= *pep_ | ~(PTE_P | PTE_W | PTE_U);
+        --level_;
+        pep_ = &pa2ka<x86_64_pagetable*>(*pep_ & PTE_PAMASK)
+            ->entry[pageindex(va, level_)];
+    }
+    assert(pa2ka<x86_64_pagetable*>(*pep_ & PTE_PAMASK) == pt);
+    *pep_ = pa | flags | ad | PTE_PS;
+    kfree(reinterpret_cast<x86_64_page*>(pt));
+    return true;
+}
+
+
+int vmiter::map_range(uintptr_t pa, size_t npages, int perm) {
+    assert(perm & PTE_P);
+    while (npages > 0) {
+        // `map()` allocates any missing page table pages
+        if (map(pa, perm) < 0) {
+            return -1;
+        }
+        size_t n = MIN(npages, size_t(512 - pageindex(va_, 0)));
+        for (size_t i = 1; i < n; ++i) {
+            pep_[i] = (pa + i * PAGESIZE) | perm;
+        }
+        npages -= n;
+        pa += n * PAGESIZE;
+        real_find(va_ + n * PAGESIZE);
+    }
+    return 0;
+}
+
+int vmiter::unmap_range(size_t npages, tlb_batch& tlb) {
+    assert(!(va_ & PAGEOFFMASK));
+    while (npages > 0) {
+        size_t span = (pageoffmask(level_) + 1) / PAGESIZE;
+        size_t off = (va_ & pageoffmask(level_)) / PAGESIZE;
+        size_t n = MIN(npages, span - off);
+        if (!(*pep_ & PTE_P)) {
+            // nothing mapped here
+        } else if (level_ > 0 && n < span) {
+            // partially covered large page
+            if (split() < 0) {
+                return -1;
+            }
+            continue;
+        } else if (level_ > 0) {
+            uintptr_t pa = this->pa();
+            *pep_ = 0;
+            tlb.add(va_, span * PAGESIZE);
+            for (size_t i = 0; i != span; ++i) {
+                tlb.free_page(pa2ka<x86_64_page*>(pa + i * PAGESIZE));
+            }
+        } else {
+            for (size_t i = 0; i != n; ++i) {
+                x86_64_pageentry_t e = pep_[i];
+                if (e & PTE_P) {
+                    pep_[i] = 0;
+                    tlb.add(va_ + i * PAGESIZE);
+                    tlb.free_page(pa2ka<x86_64_page*>(e & PTE_PAMASK));
+                }
+            }
+        }
+        npages -= n;
+        real_find(va_ + n * PAGESIZE);
+    }
+    return 0;
+}
+
+int vmiter::protect_range(size_t npages, int perm, tlb_batch* tlb) {
+    // flags replaced by `perm`: P, W, U, PWT, PCD, and software bits
+    constexpr uint64_t permmask = 0xE1F;
+    assert(!(va_ & PAGEOFFMASK));
+    assert((perm & PTE_P) && !(perm & ~permmask));
+    while (npages > 0) {
+        size_t span = (pageoffmask(level_) + 1) / PAGESIZE;
+        size_t off = (va_ & pageoffmask(level_)) / PAGESIZE;
+        size_t n = MIN(npages, span - off);
+        if (!(*pep_ & PTE_P)) {
+            // nothing mapped here
+        } else if (level_ > 0 && n < span) {
+            if (split() < 0) {
+                return -1;
+            }
+            continue;
+        } else {
+            // upper levels must allow at least `perm`
+            assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
+            size_t nent = level_ > 0 ? 1 : n;
+            for (size_t i = 0; i != nent; ++i) {
+                if (pep_[i] & PTE_P) {
+                    pep_[i] = (pep_[i] & ~permmask) | perm;
+                }
+            }
+            if (tlb) {
+                tlb->add(va_, n * PAGESIZE);
+            }
+        }
+        npages -= n;
+        real_find(va_ + n * PAGESIZE);
     }
     return 0;
 }
@@ -24,6 +24,13 @@ class vmiter {
     inline bool present() const;      // is va present?
     inline bool writable() const;     // is va writable?
     inline bool user() const;         // is va user-accessible (unprivileged)?
+    inline int level() const;         // level of current mapping
+                                      // (0 = 4KiB, 1 = 2MiB, 2 = 1GiB)
+
+    // clear `bits` (such as PTE_A | PTE_D) in the current mapping and
+    // return which of them were set. The processor may not set them
+    // again until stale TLB entries are flushed.
+    inline uint64_t test_and_clear(uint64_t bits);
 
     inline vmiter& find(uintptr_t va);   // change virtual address to `va`
     inline vmiter& operator+=(intptr_t delta);  // advance `va` by `delta`
@@ -39,6 +46,46 @@ class vmiter {
     // negative on failure.
     int map(uintptr_t pa, int perm = PTE_P | PTE_W | PTE_U);
 
+    // map current va to `pa` with a page at `level` (0 = 4KiB,
+    // 1 = 2MiB, 2 = 1GiB). Current va and `pa` must be aligned to that
+    // page size, and no page table page may exist at `level`. Larger
+    // pages covering va are split as necessary. Returns 0 on success,
+    // negative on failure (including 1GiB pages on CPUs without them).
+    int map(uintptr_t pa, int perm, int level);
+
+    // map `npages` pages starting at current va to consecutive physical
+    // pages starting at `pa`, filling each page table page in one pass.
+    // Current va and `pa` must be page-aligned and `perm` must include
+    // PTE_P. Leaves the iterator after the last page. Returns 0 on
+    // success, negative on failure (some pages may have been mapped).
+    int map_range(uintptr_t pa, size_t npages,
+                  int perm = PTE_P | PTE_W | PTE_U);
+
+    // unmap `npages` pages starting at current va, skipping unmapped
+    // upper-level ranges wholesale. Unmapped ranges are added to `tlb`
+    // and the unmapped pages are freed after it flushes. Returns 0 on
+    // success, negative on failure.
+    int unmap_range(size_t npages, tlb_batch& tlb);
+
+    // change the permissions of present pages among the `npages` pages
+    // starting at current va to `perm`, which must include PTE_P.
+    // Physical addresses and accessed/dirty bits are kept. Changed ranges
+    // are added to `tlb` if it is nonnull. Returns 0 on success,
+    // negative on failure.
+    int protect_range(size_t npages, int perm, tlb_batch* tlb = nullptr);
+
+    // replace the large page mapping va with a table of smaller pages
+    // with the same translation. Returns 0 on success, negative on
+    // failure.
+    int split();
+
+    // if the 2MiB-aligned range containing va is mapped by 512 4KiB
+    // pages with identical permissions and physically contiguous,
+    // 2MiB-aligned addresses, replace them with one 2MiB page and free
+    // the level-0 page table page. Returns true if promoted. The caller
+    // must flush stale TLB entries for the range.
+    bool try_promote();
+
   private:
     x86_64_pagetable* pt_;
     x86_64_pageentry_t* pep_;
@@ -123,7 +170,7 @@ inline T vmiter::ka() const {
 }
 inline uint64_t vmiter::perm() const {
     if (*pep_ & PTE_P) {
-        return *pep_ & perm_;
+        return *pep_ & perm_ & ~PTE_PS;
     } else {
         return 0;
     }
@@ -137,6 +184,13 @@ inline bool vmiter::writable() const {
 inline bool vmiter::user() const {
     return (*pep_ & perm_ & (PTE_P | PTE_U)) == (PTE_P | PTE_U);
 }
+inline int vmiter::level() const {
+    return level_;
+}
+inline uint64_t vmiter::test_and_clear(uint64_t bits) {
+    assert(*pep_ & PTE_P);
+    return __atomic_fetch_and(pep_, ~bits, __ATOMIC_RELAXED) & bits;
+}
 inline vmiter& vmiter::find(uintptr_t va) {
     real_find(va);
     return *this;
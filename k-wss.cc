@@ -0,0 +1,136 @@
+#include "kernel.hh"
+#include "k-vmiter.hh"
+
+// k-wss.cc
+//
+//    Working-set estimation. About every WSS_INTERVAL ticks, a process
+//    that takes a timer interrupt in user mode scans its own user
+//    mappings, counting and clearing the accessed and dirty bits the
+//    processor set since the previous scan. Scanning from the process's
+//    own context means no other CPU can be changing its page table.
+//    The counts feed smoothed working-set-size and dirty-rate
+//    estimates, which `sys_getwss` reports.
+//
+//    A process that is blocked or sleeping takes no timer interrupts in
+//    user mode, so it is not scanned, but it touches no memory either.
+//    Each whole interval that passes without a scan therefore counts as
+//    a sample of zero: the next scan applies those samples before its
+//    own, and `sys_getwss` applies them to the estimates it reports.
+
+#define WSS_SHIFT               2       // weight of new samples: 1/4
+#define WSS_MAXMISSED           64      // decays to zero well before this
+
+
+// ewma(avg, sample)
+//    Return the moving average `avg` updated with `sample`. The step
+//    toward `sample` is rounded away from `avg`, so the average reaches
+//    any steady sample exactly, whether rising or falling.
+
+static uint64_t ewma(uint64_t avg, uint64_t sample) {
+    constexpr uint64_t round = (1U << WSS_SHIFT) - 1;
+    if (sample >= avg) {
+        return avg + ((sample - avg + round) >> WSS_SHIFT);
+    } else {
+        return avg - ((avg - sample + round) >> WSS_SHIFT);
+    }
+}
+
+
+// wss_decay(info, last_tick, now)
+//    Apply a zero sample to `info`'s estimates for each whole scan
+//    interval missed between `last_tick`, the last scan, and `now`.
+
+static void wss_decay(wss_info& info, unsigned long last_tick,
+                      unsigned long now) {
+    if (info.scans == 0) {
+        return;
+    }
+    unsigned long missed = (now - last_tick) / WSS_INTERVAL;
+    missed = missed > 0 ? missed - 1 : 0;
+    for (unsigned long i = 0; i != missed && i != WSS_MAXMISSED; ++i) {
+        info.wss = ewma(info.wss, 0);
+        info.dirty_rate = ewma(info.dirty_rate, 0);
+    }
+}
+
+
+// proc::wss_scan()
+//    Sample and clear the accessed and dirty bits of this process's user
+//    mappings and update `wss_`. Must run on this process's page table
+//    with `vmlock_` held.
+
+void proc::wss_scan() {
+    unsigned long now = ktime.ticks();
+    unsigned long elapsed = now - wss_tick_;
+    wss_decay(wss_, wss_tick_, now);
+    wss_tick_ = now;
+
+    uint64_t resident = 0, accessed = 0, dirtied = 0;
+    for (vmiter it(this, 0); it.low(); ) {
+        if (!it.user()) {
+            it.next();
+            continue;
+        }
+        uintptr_t size = pageoffmask(it.level()) + 1;
+        uint64_t npages = size / PAGESIZE;
+        uint64_t bits = it.test_and_clear(PTE_A | PTE_D);
+        resident += npages;
+        if (bits & PTE_A) {
+            accessed += npages;
+        }
+        if (bits & PTE_D) {
+            dirtied += npages;
+        }
+        it.find(ROUNDDOWN(it.va(), size) + size);
+    }
+
+    // cached translations would hide later accesses
+    tlb_batch(this).add(0, VA_LOWMAX + 1);
+
+    // after missed intervals, which counted as zero samples, the pages
+    // dirtied before the process blocked count against one interval
+    elapsed = elapsed < WSS_INTERVAL * 2 ? elapsed : WSS_INTERVAL;
+    uint64_t rate = elapsed ? dirtied * HZ / elapsed : 0;
+    if (wss_.scans == 0) {
+        wss_.wss = accessed;
+        wss_.dirty_rate = rate;
+    } else {
+        wss_.wss = ewma(wss_.wss, accessed);
+        wss_.dirty_rate = ewma(wss_.dirty_rate, rate);
+    }
+    wss_.resident = resident;
+    wss_.accessed = accessed;
+    wss_.dirtied = dirtied;
+    ++wss_.scans;
+}
+
+
+// proc::syscall_getwss(pid, addr)
+//    Copy the working-set estimates of process `pid`, or of this process
+//    if `pid == 0`, to user address `addr`. Estimates not refreshed by a
+//    recent scan are decayed first.
+
+int proc::syscall_getwss(pid_t pid, uintptr_t addr) {
+    if (pid < 0 || pid >= NPROC) {
+        return E_INVAL;
+    }
+    wss_info info;
+    unsigned long tick;
+    if (pid == 0 || pid == pid_) {
+        info = wss_;
+        tick = wss_tick_;
+    } else {
+        auto irqs = rcu_read_lock();
+        proc* p = ptable_lookup(pid);
+        if (p) {
+            info = p->wss_;
+            tick = p->wss_tick_;
+        }
+        rcu_read_unlock(irqs);
+        if (!p) {
+            return E_INVAL;
+        }
+    }
+    wss_decay(info, tick, ktime.ticks());
+    return copy_to_user(addr, &info, sizeof(info));
+}
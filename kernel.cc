@@ -6,7 +6,14 @@
 //
 //    This is the kernel.
 
-unsigned long ticks;            // # timer interrupts so far on CPU 0
+timekeeper ktime;               // advanced by timer interrupts on CPU 0
+
+// first process run if the boot loader passes no command (`make P=name`)
+#ifndef CHICKADEE_FIRST_PROCESS
+#define CHICKADEE_FIRST_PROCESS "allocator"
+#endif
+
+static bool memshow_enabled;    // draw the memory viewer on timer ticks
 
 static void memshow();
 static void process_setup(pid_t pid, const char* program_name);
@@ -14,7 +21,9 @@ static void process_setup(pid_t pid, const char* program_name);
 
 // kernel_start(command)
 //    Initialize the hardware and processes and start running. The `command`
-//    string is an optional string passed from the boot loader.
+//    string is an optional string passed from the boot loader; if it names
+//    a program `p-COMMAND`, that program runs as the first process.
+//    Otherwise `p-allocator` runs, with the memory viewer.
 
 void kernel_start(const char* command) {
     hardware_init();
@@ -25,10 +34,23 @@ void kernel_start(const char* command) {
         ptable[i] = nullptr;
     }
 
+    char name[32];
+    size_t size;
+    snprintf(name, sizeof(name), "p-%s",
+             command ? command : CHICKADEE_FIRST_PROCESS);
+    if (!flatfs_find(name, &size)) {
+        strcpy(name, "p-allocator");
+    }
+    memshow_enabled = strcmp(name, "p-allocator") == 0;
+
     auto irqs = ptable_lock.lock();
-    process_setup(1, "p-allocator");
+    process_setup(1, name);
     ptable_lock.unlock(irqs);
 
+    // Start the page deduplicator and the system call ring poller
+    ksm_start();
+    ring_start();
+
     // Switch to the first process
     cpus[0].schedule(nullptr);
 }
@@ -37,23 +59,29 @@ void kernel_start(const char* command) {
 // process_setup(pid, name)
 //    Load application program `name` as process number `pid`.
 //    This loads the application's code and data into memory, sets its
-//    %rip and %rsp, gives it a stack page, and marks it as runnable.
+//    %rip and %rsp, reserves its stack region, and marks it as runnable.
+//    Stack pages are allocated on first touch.
 
 void process_setup(pid_t pid, const char* name) {
     assert(!ptable[pid]);
-    proc* p = ptable[pid] = reinterpret_cast<proc*>(kallocpage());
+    proc* p = reinterpret_cast<proc*>(kallocpage());
     x86_64_pagetable* npt = kalloc_pagetable();
     assert(p && npt);
     p->init_user(pid, npt);
 
-    int r = p->load(name);
+    int r = p->map_kinfo();
+    assert(r >= 0);
+    r = p->load(name);
     assert(r >= 0);
     p->regs_->reg_rsp = MEMSIZE_VIRTUAL;
-    x86_64_page* stkpg = kallocpage();
-    assert(stkpg);
-    vmiter(p, p->regs_->reg_rsp - PAGESIZE).map(ka2pa(stkpg));
+    r = p->add_vma(MEMSIZE_VIRTUAL - USER_STACK_SIZE, MEMSIZE_VIRTUAL);
+    assert(r >= 0);
+
+    // publish the fully-initialized process to RCU readers
+    rcu_assign_pointer(ptable[pid], p);
 
     int cpu = pid % ncpu;
+    p->cpu_ = cpu;
     cpus[cpu].runq_lock_.lock_noirq();
     cpus[cpu].enqueue(p);
     cpus[cpu].runq_lock_.unlock_noirq();
@@ -74,21 +102,28 @@ void proc::exception(regstate* regs) {
     // Events logged this way are stored in the host's `log.txt` file.
     /*log_printf("proc %d: exception %d\n", this->pid_, regs->reg_intno);*/
 
-    // Show the current cursor location.
-    console_show_cursor(cursorpos);
-
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
-
-
     // Actually handle the exception.
     switch (regs->reg_intno) {
 
     case INT_IRQ + IRQ_TIMER: {
+        kstat_add(kstat_timer_interrupts);
         cpustate* cpu = this_cpu();
         if (cpu->index_ == 0) {
-            ++ticks;
-            memshow();
+            ktime.tick();
+            futex_expire(ktime.ticks());
+            ksm_expire(ktime.ticks());
+            ring_expire(ktime.ticks());
+            if (memshow_enabled) {
+                memshow();
+            }
+            // user code may have printed; show the current cursor
+            console_show_cursor(cursorpos);
+        }
+        if ((regs->reg_cs & 3)
+            && ktime.ticks() - wss_tick_ >= WSS_INTERVAL
+            && vmlock_.try_lock()) {
+            wss_scan();
+            vmlock_.unlock();
         }
         lapicstate::get().ack();
         this->regs_ = regs;
@@ -96,7 +131,30 @@ void proc::exception(regstate* regs) {
         break;                  /* will not be reached */
     }
 
+    case INT_IRQ + IRQ_KEYBOARD:
+        keyboard_interrupt();
+        break;
+
+    case INT_IRQ + IRQ_TLBSHOOTDOWN:
+        tlb_shootdown_handle();
+        lapicstate::get().ack();
+        break;
+
+    case INT_DEVICE:
+        if ((regs->reg_cs & 3) == 0) {
+            panic("Kernel FPU use (rip=%p)!\n", regs->reg_rip);
+        }
+        if (fpu_trap()) {
+            break;
+        }
+        console_printf(CPOS(24, 0), 0x0C00,
+                       "Process %d out of memory for FPU state!\n", pid_);
+        this->state_ = proc::broken;
+        this->yield();
+        break;
+
     case INT_PAGEFAULT: {
+        kstat_add(kstat_pagefaults);
         // Analyze faulting address and access type.
         uintptr_t addr = rcr2();
         const char* operation = regs->reg_err & PFERR_WRITE
@@ -108,6 +166,12 @@ void proc::exception(regstate* regs) {
             panic("Kernel page fault for %p (%s %s, rip=%p)!\n",
                   addr, operation, problem, regs->reg_rip);
         }
+        vmlock_.lock();
+        bool handled = handle_page_fault(addr, regs->reg_err);
+        vmlock_.unlock();
+        if (handled) {
+            break;
+        }
         console_printf(CPOS(24, 0), 0x0C00,
                        "Process %d page fault for %p (%s %s, rip=%p)!\n",
                        pid_, addr, operation, problem, regs->reg_rip);
@@ -128,6 +192,182 @@ void proc::exception(regstate* regs) {
 }
 
 
+// System call table
+//    Entry `n` describes system call number `n`: its name, number of
+//    arguments, flags, and handler. Handlers take their arguments from
+//    `regs` in the `syscall` calling convention (%rdi, %rsi, %rdx, %r10,
+//    %r8, %r9). Entries with `SYSF_VMLOCK` run with `vmlock_` held, since
+//    they change this process's mappings or may fault in pages (see
+//    `k-ksm.cc`); entries with `SYSF_RING` may also be queued on a system
+//    call ring (see `k-ring.cc`).
+
+constexpr syscall_desc proc::syscall_table[NSYSCALL] = {
+    {0, nullptr, 0, 0, nullptr},
+
+    {SYSCALL_GETPID, "getpid", 0, SYSF_RING,
+     [](proc* p, regstate*) -> uintptr_t {
+         return p->pid_;
+     }},
+
+    {SYSCALL_YIELD, "yield", 0, 0,
+     [](proc* p, regstate*) -> uintptr_t {
+         p->yield();
+         return 0;
+     }},
+
+    {SYSCALL_PAUSE, "pause", 0, 0,
+     [](proc*, regstate*) -> uintptr_t {
+         sti();
+         for (uintptr_t delay = 0; delay < 1000000; ++delay) {
+             pause();
+         }
+         cli();
+         return 0;
+     }},
+
+    {SYSCALL_PANIC, "panic", 0, 0,
+     [](proc*, regstate*) -> uintptr_t {
+         panic(NULL);
+     }},
+
+    {SYSCALL_PAGE_ALLOC, "page_alloc", 1, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_page_alloc(regs->reg_rdi);
+     }},
+
+    {SYSCALL_FORK, "fork", 0, 0,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_fork(regs);
+     }},
+
+    {SYSCALL_EXIT, "exit", 1, 0,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         p->syscall_exit(regs->reg_rdi);
+     }},
+
+    {SYSCALL_FUTEX_WAIT, "futex_wait", 3, 0,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return futex_wait(p, regs->reg_rdi, regs->reg_rsi, regs->reg_rdx);
+     }},
+
+    {SYSCALL_FUTEX_WAKE, "futex_wake", 2, SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return futex_wake(p, regs->reg_rdi, regs->reg_rsi);
+     }},
+
+    {SYSCALL_WAITPID, "waitpid", 3, 0,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_waitpid(regs->reg_rdi, regs->reg_rsi,
+                                   regs->reg_rdx);
+     }},
+
+    {SYSCALL_SHM_CREATE, "shm_create", 1, 0,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return shm_create(p, regs->reg_rdi);
+     }},
+
+    {SYSCALL_SHM_MAP, "shm_map", 3, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return shm_map(p, regs->reg_rdi, regs->reg_rsi, regs->reg_rdx);
+     }},
+
+    {SYSCALL_SHM_UNMAP, "shm_unmap", 1, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return shm_unmap(p, regs->reg_rdi);
+     }},
+
+    {SYSCALL_MMAP, "mmap", 6, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_mmap(regs->reg_rdi, regs->reg_rsi, regs->reg_rdx,
+                                regs->reg_r10, regs->reg_r8, regs->reg_r9);
+     }},
+
+    {SYSCALL_MUNMAP, "munmap", 2, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_munmap(regs->reg_rdi, regs->reg_rsi);
+     }},
+
+    {SYSCALL_MPROTECT, "mprotect", 3, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_mprotect(regs->reg_rdi, regs->reg_rsi,
+                                    regs->reg_rdx);
+     }},
+
+    {SYSCALL_MADVISE, "madvise", 3, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_madvise(regs->reg_rdi, regs->reg_rsi,
+                                   regs->reg_rdx);
+     }},
+
+    {SYSCALL_GETWSS, "getwss", 2, SYSF_VMLOCK | SYSF_RING,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_getwss(regs->reg_rdi, regs->reg_rsi);
+     }},
+
+    {SYSCALL_RING_SETUP, "ring_setup", 1, SYSF_VMLOCK,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_ring_setup(regs->reg_rdi);
+     }},
+
+    {SYSCALL_RING_ENTER, "ring_enter", 1, SYSF_VMLOCK,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_ring_enter(regs->reg_rdi);
+     }},
+
+    {SYSCALL_STATS, "stats", 1, SYSF_VMLOCK,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_stats(regs->reg_rdi);
+     }},
+
+    {SYSCALL_KSTATS, "kstats", 2, SYSF_VMLOCK,
+     [](proc* p, regstate* regs) -> uintptr_t {
+         return p->syscall_kstats(regs->reg_rdi, regs->reg_rsi);
+     }},
+
+    {SYSCALL_GETC, "getc", 0, 0,
+     [](proc*, regstate*) -> uintptr_t {
+         int c = keyboard_getc();
+         return c >= 0 ? c : E_AGAIN;
+     }}
+};
+
+
+// proc::syscall_table_ok()
+//    Return true iff every `syscall_table` entry is at its number.
+
+constexpr bool proc::syscall_table_ok() {
+    for (int i = 0; i != NSYSCALL; ++i) {
+        if (syscall_table[i].nr_ != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Per-CPU system call statistics
+//    Each CPU updates only its own shard, and only with interrupts
+//    disabled, so plain increments suffice. The alignment keeps shards
+//    from sharing cache lines.
+
+struct __attribute__((aligned(64))) syscall_stats_shard {
+    syscall_stat s_[NSYSCALL];
+};
+static syscall_stats_shard cpu_syscall_stats[NCPU];
+
+
+// syscall_bucket(cycles)
+//    Return the `syscall_stat::hist` bucket for a call taking `cycles`.
+
+static unsigned syscall_bucket(uint64_t cycles) {
+    if (cycles < 128) {
+        return 0;
+    }
+    unsigned b = 63 - __builtin_clzl(cycles) - 6;
+    return b < SYSSTAT_NBUCKET ? b : SYSSTAT_NBUCKET - 1;
+}
+
+
 // proc::syscall(regs)
 //    System call handler.
 //
@@ -136,50 +376,533 @@ void proc::exception(regstate* regs) {
 //    process in `%rax`.
 
 uintptr_t proc::syscall(regstate* regs) {
-    switch (regs->reg_rax) {
+    static_assert(syscall_table_ok(), "system call table out of order");
+    kstat_add(kstat_syscalls);
+    ++kinfo_->syscalls;
 
-    case SYSCALL_PANIC:
-        panic(NULL);
-        break;                  // will not be reached
+    uintptr_t nr = regs->reg_rax;
+    if (nr >= NSYSCALL || !syscall_table[nr].fn_) {
+        // no such system call
+        log_printf("%d: no such system call %u\n", pid_, nr);
+        return -1;
+    }
+    const syscall_desc& d = syscall_table[nr];
+    ++cpu_syscall_stats[this_cpu_read(index_)].s_[nr].calls;
+
+    uint64_t t0 = rdtsc();
+    uintptr_t r;
+    if (d.flags_ & SYSF_VMLOCK) {
+        vmlock_.lock();
+        r = d.fn_(this, regs);
+        vmlock_.unlock();
+    } else {
+        r = d.fn_(this, regs);
+    }
+    uint64_t cycles = rdtsc() - t0;
 
-    case SYSCALL_GETPID:
-        return pid_;
+    // a blocking call may have slept, but it resumes on the same CPU
+    syscall_stat& st = cpu_syscall_stats[this_cpu_read(index_)].s_[nr];
+    st.cycles += cycles;
+    ++st.hist[syscall_bucket(cycles)];
+    return r;
+}
+
+
+// proc::syscall_page_alloc(addr)
+//    Map a fresh zeroed page at user address `addr`, replacing any page
+//    there. Returns 0 or -1.
+
+int proc::syscall_page_alloc(uintptr_t addr) {
+    if (addr > VA_USERMAX || addr & 0xFFF) {
+        return -1;
+    }
+    x86_64_page* pg = kallocpage();
+    if (!pg) {
+        return -1;
+    }
+    // freed pages are reused, so clear old contents
+    memset(pg, 0, PAGESIZE);
+    vmiter it(this, addr);
+    x86_64_page* oldpg = it.present() ? it.ka<x86_64_page*>() : nullptr;
+    if (it.map(ka2pa(pg)) < 0) {
+        kfree(pg);
+        return -1;
+    }
+    if (oldpg) {
+        tlb_batch tlb(this);
+        tlb.add(addr);
+        tlb.free_page(oldpg);
+    }
+    return 0;
+}
 
-    case SYSCALL_YIELD:
-        this->yield();
-        return 0;
 
-    case SYSCALL_PAGE_ALLOC: {
-        uintptr_t addr = regs->reg_rdi;
-        if (addr >= 0x800000000000 || addr & 0xFFF) {
-            return -1;
+// proc::syscall_stats(addr)
+//    Copy each system call's statistics, summed over all CPUs, to the
+//    `syscall_stat[NSYSCALL]` array at user address `addr`, or write a
+//    table of them to the log if `addr == 0`. The sums are not a
+//    snapshot: other CPUs keep counting.
+
+int proc::syscall_stats(uintptr_t addr) {
+    for (int nr = 1; nr != NSYSCALL; ++nr) {
+        syscall_stat sum;
+        memset(&sum, 0, sizeof(sum));
+        for (int i = 0; i != ncpu; ++i) {
+            const syscall_stat& st = cpu_syscall_stats[i].s_[nr];
+            sum.calls += __atomic_load_n(&st.calls, __ATOMIC_RELAXED);
+            sum.cycles += __atomic_load_n(&st.cycles, __ATOMIC_RELAXED);
+            for (int b = 0; b != SYSSTAT_NBUCKET; ++b) {
+                sum.hist[b] += __atomic_load_n(&st.hist[b], __ATOMIC_RELAXED);
+            }
         }
-        x86_64_page* pg = kallocpage();
-        if (!pg || vmiter(this, addr).map(ka2pa(pg)) < 0) {
-            return -1;
+        if (addr) {
+            int r = copy_to_user(addr + nr * sizeof(sum), &sum, sizeof(sum));
+            if (r < 0) {
+                return r;
+            }
+        } else if (sum.calls) {
+            uint64_t returned = 0;
+            for (int b = 0; b != SYSSTAT_NBUCKET; ++b) {
+                returned += sum.hist[b];
+            }
+            log_printf("%-10s %8lu calls %10lu cycles/call\n",
+                       syscall_table[nr].name_, sum.calls,
+                       returned ? sum.cycles / returned : 0);
         }
-        return 0;
     }
+    return 0;
+}
+
 
-    case SYSCALL_PAUSE: {
-        sti();
-        for (uintptr_t delay = 0; delay < 1000000; ++delay) {
-            pause();
+// proc::syscall_kstats(addr, n)
+//    Copy the first `n` kernel statistics, summed over all CPUs, to the
+//    `uint64_t` array at user address `addr`, or write them all to the
+//    log if `addr == 0`. Returns the number of statistics the kernel
+//    keeps, `nkstat`, or a negative error.
+
+int proc::syscall_kstats(uintptr_t addr, size_t n) {
+    static const char* const names[nkstat] = {
+        "syscalls", "pagefaults", "timer_interrupts", "context_switches",
+        "tlb_shootdowns", "tlb_ipis", "tlb_shootdown_cycles",
+        "faults_avoided", "ksm_scanned", "ksm_merged", "ksm_saved",
+        "ksm_cycles", "ring_ops"
+    };
+    static_assert(nkstat == 13, "update `names` with `kstat_t`");
+
+    for (int i = 0; i != nkstat; ++i) {
+        uint64_t v = kstat_read(kstat_t(i));
+        if (!addr) {
+            log_printf("%-20s %12lu\n", names[i], v);
+        } else if (size_t(i) < n) {
+            int r = copy_to_user(addr + i * sizeof(v), &v, sizeof(v));
+            if (r < 0) {
+                return r;
+            }
         }
-        cli();
-        return 0;
     }
+    return nkstat;
+}
+
+
+// timekeeper::tick()
+//    Advance time by one tick and recalibrate the TSC frequency from the
+//    cycles elapsed since the previous tick.
+
+void timekeeper::tick() {
+    uint64_t tsc = rdtsc();
+    auto irqs = lock_.write_lock();
+    ++t_.ticks;
+    if (t_.tsc_base) {
+        uint64_t hz = (tsc - t_.tsc_base) * HZ;
+        t_.tsc_hz = t_.tsc_hz ? (7 * t_.tsc_hz + hz) / 8 : hz;
+    }
+    t_.tsc_base = tsc;
+    kinfo_update_time(t_);
+    lock_.write_unlock(irqs);
+}
+
+
+// free_user_pages(pt)
+//    Drop references to all user pages mapped in `pt`, in batches. The
+//    mappings are left in place, so `pt` must not be loaded on any CPU.
+
+static void free_user_pages(x86_64_pagetable* pt) {
+    x86_64_page* batch[64];
+    size_t n = 0;
+    for (vmiter it(pt, 0); it.low(); it.next()) {
+        if (it.user()) {
+            if (n == arraysize(batch)) {
+                kfree_pages(batch, n);
+                n = 0;
+            }
+            batch[n] = it.ka<x86_64_page*>();
+            ++n;
+        }
+    }
+    kfree_pages(batch, n);
+}
+
+// free_pagetable(pt)
+//    Free `pt` and its page table pages.
+
+static void free_pagetable(x86_64_pagetable* pt) {
+    for (ptiter it(pt, 0); it.low(); it.next()) {
+        kfree(reinterpret_cast<x86_64_page*>(it.ptp()));
+    }
+    kfree(reinterpret_cast<x86_64_page*>(pt));
+}
+
+// free_user_pagetable(pt)
+//    Drop references to all user pages mapped in `pt`, then free `pt`
+//    and its page table pages.
+
+static void free_user_pagetable(x86_64_pagetable* pt) {
+    free_user_pages(pt);
+    free_pagetable(pt);
+}
 
-    case SYSCALL_FORK:
-        // Your code here
+
+// PIDs claimed by `sys_fork` for children still being built. Protected
+// by `ptable_lock`.
+static bool fork_reserved[NPROC];
+
+
+// release_pid(pid)
+//    Give back a PID claimed by `sys_fork` whose child was never
+//    published.
+
+static void release_pid(pid_t pid) {
+    auto irqs = ptable_lock.lock();
+    fork_reserved[pid] = false;
+    ptable_lock.unlock(irqs);
+}
+
+
+// proc::syscall_fork(regs)
+//    Create a copy of this process that shares its user pages
+//    copy-on-write. Writable pages become read-only `PTE_COW` pages in
+//    both processes, and each gains a reference; the child gets its own
+//    page table pages. Returns the child's PID to the parent and 0 to
+//    the child, or -1 on failure.
+//
+//    `ptable_lock` is held only to claim a PID and to publish the child:
+//    the child is invisible until then, and `vmlock_` keeps this
+//    process's address space still while it is copied.
+
+pid_t proc::syscall_fork(regstate* regs) {
+    auto irqs = ptable_lock.lock();
+    pid_t pid = 1;
+    while (pid < NPROC && (ptable[pid] || fork_reserved[pid])) {
+        ++pid;
+    }
+    if (pid != NPROC) {
+        fork_reserved[pid] = true;
+    }
+    ptable_lock.unlock(irqs);
+    if (pid == NPROC) {
         return -1;
+    }
 
-    default:
-        // no such system call
-        log_printf("%d: no such system call %u\n", pid_, regs->reg_rax);
+    vmlock_.lock();
+    proc* child = nullptr;
+    x86_64_pagetable* pt = nullptr;
+    if (!(child = reinterpret_cast<proc*>(kallocpage()))
+        || !(pt = kalloc_pagetable())) {
+        kfree(reinterpret_cast<x86_64_page*>(child));
+        vmlock_.unlock();
+        release_pid(pid);
+        return -1;
+    }
+    child->init_user(pid, pt);
+    if (copy_vmas(child) < 0) {
+        free_pagetable(pt);
+        kfree(reinterpret_cast<x86_64_page*>(child));
+        vmlock_.unlock();
+        release_pid(pid);
         return -1;
+    }
+
+    // share user pages; the child has its own kernel info page
+    tlb_batch tlb(this);
+    int r = child->map_kinfo();
+    for (vmiter it(this, 0); r == 0 && it.low(); it.next()) {
+        if (!it.user() || it.va() > VA_USERMAX) {
+            continue;
+        }
+        int perm = it.perm();
+        // shared memory stays shared; other writable pages become COW
+        if ((perm & (PTE_W | PTE_SHARED)) == PTE_W) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            r = it.map(it.pa(), perm);
+            assert(r == 0);
+            tlb.add(it.va());
+        }
+        r = vmiter(child, it.va()).map(it.pa(), perm);
+        if (r == 0) {
+            kincref(it.ka<x86_64_page*>());
+        }
+    }
+    if (r == 0) {
+        r = fpu_fork(child);
+    }
+    if (r < 0) {
+        free_user_pagetable(pt);
+        child->free_vmas();
+        child->fpu_free();
+        kfree(reinterpret_cast<x86_64_page*>(child));
+        tlb.flush();
+        vmlock_.unlock();
+        release_pid(pid);
+        return -1;
+    }
+
+    // child returns 0 from `sys_fork()`
+    *child->regs_ = *regs;
+    child->regs_->reg_rax = 0;
+
+    int cpu = pid % ncpu;
+    child->cpu_ = cpu;
+    child->ppid_ = pid_;
+    child->kinfo_->ppid = pid_;
+    shm_fork(this, child);
+
+    irqs = ptable_lock.lock();
+    fork_reserved[pid] = false;
+    rcu_assign_pointer(ptable[pid], child);
+    ptable_lock.unlock(irqs);
+
+    // our own writable mappings just became read-only; flush them
+    // before the child can run
+    tlb.flush();
+    vmlock_.unlock();
+
+    irqs = cpus[cpu].runq_lock_.lock();
+    cpus[cpu].enqueue(child);
+    cpus[cpu].runq_lock_.unlock(irqs);
+    return pid;
+}
+
+
+// free_proc_rcu(head)
+//    RCU callback that frees a reaped process's page tables and `proc`
+//    page. Its user pages were freed when it exited.
+
+static void free_proc_rcu(rcu_head* head) {
+    proc* p = reinterpret_cast<proc*>(ROUNDDOWN(uintptr_t(head), PAGESIZE));
+    assert(&p->rcu_ == head && p->state_ == proc::exited);
+    free_pagetable(p->pagetable_);
+    kfree(reinterpret_cast<x86_64_page*>(p));
+}
+
+// reap(p)
+//    Remove exited process `p` from `ptable` and free it once no RCU
+//    reader (and no CPU still on `p`'s kernel stack) can observe it.
+//    `ptable_lock` must be held.
+
+static void reap(proc* p) {
+    assert(p->state_ == proc::exited);
+    rcu_assign_pointer(ptable[p->pid_], nullptr);
+    call_rcu(&p->rcu_, free_proc_rcu);
+}
+
+
+// proc::syscall_exit(status)
+//    Exit this process. User memory is freed right away with no
+//    shootdown. With PCIDs, TLBs may still cache the process's
+//    translations, but only under PCIDs assigned to it, and those are
+//    never loaded again: the process switches to `early_pagetable` and
+//    never runs again, and `load_pagetable` hands a PCID to another
+//    process only in a later generation, after flushing the whole TLB.
+//    Without PCIDs, loading `early_pagetable` flushes the TLB. The page
+//    tables and `proc` page stay until the process is reaped by its
+//    parent, or immediately if it has none. Children are orphaned;
+//    exited orphans are reaped here.
+
+void proc::syscall_exit(int status) {
+    cpustate* c = this_cpu();
+    // `vmlock_` stays locked: the address space is gone, and the page
+    // deduplicator only ever try-locks it
+    vmlock_.lock();
+    set_pagetable(early_pagetable);
+    active_cpus_ &= ~(1U << c->index_);
+    // an exiting parent writes `kinfo_->ppid` under `ptable_lock`, so
+    // the page must be unpublished under it before it is freed
+    auto irqs = ptable_lock.lock();
+    kinfo_ = nullptr;
+    ptable_lock.unlock(irqs);
+    ring_free();
+    fpu_free();
+    free_user_pages(pagetable_);
+    free_vmas();
+    shm_exit(this);
+
+    irqs = ptable_lock.lock();
+    for (pid_t i = 1; i < NPROC; ++i) {
+        proc* child = ptable[i];
+        if (child && child->ppid_ == pid_) {
+            child->ppid_ = 0;
+            if (child->kinfo_) {
+                child->kinfo_->ppid = 0;
+            }
+            if (child->state_ == proc::exited) {
+                reap(child);
+            }
+        }
+    }
+    exit_status_ = status;
+    // `state_` is read by the scheduler without `ptable_lock`
+    c->runq_lock_.lock_noirq();
+    state_ = proc::exited;
+    c->runq_lock_.unlock_noirq();
+    proc* parent = ppid_ ? ptable[ppid_] : nullptr;
+    if (!parent) {
+        reap(this);
+    }
+    ptable_lock.unlock(irqs);
 
+    // `parent` cannot be freed before this CPU passes through the
+    // scheduler, which is an RCU quiescent state
+    if (parent) {
+        parent->waitq_.wake_all();
     }
+    yield_noreturn();
+}
+
+
+// proc::syscall_waitpid(pid, status_addr, options)
+//    Reap an exited child (`pid`, or any child if `pid == 0`), storing
+//    its exit status at user address `status_addr` if that is nonzero.
+
+pid_t proc::syscall_waitpid(pid_t pid, uintptr_t status_addr, int options) {
+    if (pid < 0 || pid >= NPROC
+        || (status_addr && (status_addr & 3))) {
+        return E_INVAL;
+    }
+    if (status_addr) {
+        // fault in a copy-on-write or demand-zero page now, so storing
+        // the status after reaping a child normally cannot fail
+        vmlock_.lock();
+        bool ok = fault_in_write(status_addr);
+        vmlock_.unlock();
+        if (!ok) {
+            return E_FAULT;
+        }
+    }
+
+    while (1) {
+        auto irqs = ptable_lock.lock();
+        bool found = false;
+        proc* zombie = nullptr;
+        for (pid_t i = pid ? pid : 1; i < (pid ? pid + 1 : NPROC); ++i) {
+            proc* child = ptable[i];
+            if (child && child->ppid_ == pid_) {
+                found = true;
+                if (child->state_ == proc::exited) {
+                    zombie = child;
+                    break;
+                }
+            }
+        }
+
+        if (zombie) {
+            pid_t zpid = zombie->pid_;
+            int status = zombie->exit_status_;
+            reap(zombie);
+            ptable_lock.unlock(irqs);
+            // the page was faulted in above, but may since have been
+            // merged copy-on-write
+            if (status_addr) {
+                vmlock_.lock();
+                int r = copy_to_user(status_addr, &status, sizeof(status));
+                vmlock_.unlock();
+                if (r < 0) {
+                    return r;
+                }
+            }
+            return zpid;
+        } else if (!found) {
+            ptable_lock.unlock(irqs);
+            return E_CHILD;
+        } else if (options & W_NOHANG) {
+            ptable_lock.unlock(irqs);
+            return E_AGAIN;
+        }
+
+        // Enqueue on `waitq_` before releasing `ptable_lock`: an exiting
+        // child marks itself exited under `ptable_lock` and only then
+        // wakes `waitq_`, so the wakeup cannot be missed.
+        auto wqirqs = waitq_.lock_.lock();
+        ptable_lock.unlock(irqs);
+        waitq_.block(this, wqirqs);
+    }
+}
+
+
+// try_promote_at(p, va)
+//    Promote the 2MiB range containing `va` in `p` to a large page if it
+//    is fully populated and `va`'s physical address is congruent to it
+//    modulo 2MiB.
+
+static void try_promote_at(proc* p, uintptr_t va) {
+    vmiter it(p, ROUNDDOWN(va, PAGESIZE));
+    if (!((it.pa() ^ it.va()) & pageoffmask(1))
+        && it.try_promote()) {
+        tlb_batch(p).add(ROUNDDOWN(va, pageoffmask(1) + 1),
+                         pageoffmask(1) + 1);
+    }
+}
+
+// proc::handle_page_fault(addr, err)
+//    Try to resolve a user page fault at `addr` with error code `err`.
+//    Handles first touches of pages in VMAs, which `fault_in` populates
+//    along with the pages `fault_around` maps ahead, and writes to
+//    copy-on-write pages: the last sharer takes the page over, others
+//    copy it. Returns true if the faulting access can be retried.
+
+bool proc::handle_page_fault(uintptr_t addr, int err) {
+    if (!(err & PFERR_PRESENT) && addr <= VA_LOWMAX) {
+        const vmarea* vma = find_vma(addr);
+        if (!vma
+            || ((err & PFERR_WRITE) && !(vma->perm_ & PTE_W))
+            || fault_in(vma, addr) < 0) {
+            return false;
+        }
+        fault_around(vma, addr);
+        // Anonymous pages may now fill a 2MiB range; check the ranges
+        // holding the faulting page and the last page mapped ahead.
+        if (!(vma->flags_ & (VMA_FILE | VMA_SHARED))) {
+            try_promote_at(this, addr);
+            uintptr_t last = fault_next_ - PAGESIZE;
+            if ((last ^ addr) & ~pageoffmask(1)) {
+                try_promote_at(this, last);
+            }
+        }
+        return true;
+    }
+    vmiter it(this, ROUNDDOWN(addr, PAGESIZE));
+    if ((err & (PFERR_WRITE | PFERR_PRESENT)) == (PFERR_WRITE | PFERR_PRESENT)
+        && it.user()
+        && (it.perm() & PTE_COW)) {
+        x86_64_page* pg = it.ka<x86_64_page*>();
+        int perm = (it.perm() & ~PTE_COW) | PTE_W;
+        if (krefcount(pg) == 1) {
+            it.map(it.pa(), perm);
+        } else {
+            x86_64_page* npg = kallocpage();
+            if (!npg) {
+                return false;
+            }
+            memcpy(npg, pg, PAGESIZE);
+            it.map(ka2pa(npg), perm);
+            tlb_batch tlb(this);
+            tlb.add(it.va());
+            tlb.free_page(pg);
+            return true;
+        }
+        tlb_batch(this).add(it.va());
+        return true;
+    }
+    return false;
 }
 
 
@@ -193,20 +916,23 @@ void memshow() {
     static int showing = 1;
 
     // switch to a new process every 0.25 sec
+    unsigned long ticks = ktime.ticks();
     if (last_ticks == 0 || ticks - last_ticks >= HZ / 2) {
         last_ticks = ticks;
         ++showing;
     }
 
-    auto irqs = ptable_lock.lock();
+    // `ptable` is read under RCU, so exiting processes cannot be freed
+    // while the viewer examines them
+    auto irqs = rcu_read_lock();
 
-    while (showing <= 2*NPROC && !ptable[showing % NPROC]) {
+    while (showing <= 2*NPROC && !rcu_dereference(ptable[showing % NPROC])) {
         ++showing;
     }
     showing = showing % NPROC;
 
     extern void console_memviewer(const proc* vmp);
-    console_memviewer(ptable[showing]);
+    console_memviewer(rcu_dereference(ptable[showing]));
 
-    ptable_lock.unlock(irqs);
+    rcu_read_unlock(irqs);
 }
@@ -3,6 +3,7 @@
 #include "x86-64.h"
 #include "lib.hh"
 #include "k-lock.hh"
+#include "k-rcu.hh"
 #include "k-memrange.hh"
 #if CHICKADEE_PROCESS
 #error "kernel.hh should not be used by process code."
@@ -17,6 +18,21 @@ struct yieldstate;
 //    Functions, constants, and definitions for the kernel.
 
 
+// Kernel statistics
+//    Each `kstat_t` (see `lib.hh`) is a sharded counter with one shard per
+//    CPU, stored in `cpustate::kstats_`. See `kstat_add()`, `kstat_read()`,
+//    and `sys_kstats`.
+
+
+// TLB shootdown request queued on a remote CPU; see `tlb_batch`
+struct tlb_range {
+    uintptr_t pt_pa_;           // physical address of affected page table
+    uintptr_t start_;
+    uintptr_t end_;
+};
+#define NTLBQUEUE               8
+
+
 // CPU state type
 struct __attribute__((aligned(4096))) cpustate {
     // These three members must come first:
@@ -34,9 +50,32 @@ struct __attribute__((aligned(4096))) cpustate {
 
     unsigned spinlock_depth_;
 
+    uint64_t pcid_gen_;                    // current PCID generation
+    unsigned pcid_next_;                   // next unused PCID in generation
+
+    spinlock tlb_lock_;                    // protects `tlb_queue_` etc.
+    unsigned tlb_nqueue_;
+    bool tlb_flush_all_;                   // queue overflowed
+    tlb_range tlb_queue_[NTLBQUEUE];       // pending invalidations
+    std::atomic<unsigned long> tlb_req_;   // # shootdowns queued
+    std::atomic<unsigned long> tlb_done_;  // # shootdowns handled
+
+    std::atomic<unsigned long> rcu_seen_;  // last RCU epoch observed
+    rcu_head* rcu_head_;                   // pending RCU callbacks
+    rcu_head** rcu_tailp_;
+
+    proc* fpu_owner_;                      // process whose FPU state is
+                                           // in this CPU's registers
+    bool fpu_ts_;                          // CR0_TS is set
+
     uint64_t gdt_segments_[7];
     x86_64_taskstate task_descriptor_;
 
+    // Per-CPU shards of kernel statistics. Only the owning CPU writes
+    // its shard; the cache-line alignment keeps readers' misses from
+    // bouncing lines holding other hot per-CPU state.
+    uint64_t kstats_[nkstat] __attribute__((aligned(64)));
+
 
     cpustate() = default;
     NO_COPY_OR_ASSIGN(cpustate);
@@ -50,10 +89,13 @@ struct __attribute__((aligned(4096))) cpustate {
 
     void enqueue(proc* p);
     void schedule(proc* yielding_from) __attribute__((noreturn));
+    void load_pagetable(proc* p);
+    void fpu_switch(proc* p);
     proc* idle_task();
 
  private:
     void init_cpu_hardware();
+    void init_fpu();
 };
 
 #define NCPU 16
@@ -62,6 +104,48 @@ extern int ncpu;
 #define CPUSTACK_SIZE 4096
 
 inline cpustate* this_cpu();
+inline proc* current();
+
+
+// Virtual memory areas
+//    A VMA describes user addresses `[start_, end_)` that a process may
+//    access with permissions `perm_`, and how the page fault handler
+//    populates them: with zeroed pages (anonymous), from file data, or
+//    not at all (shared memory, which is mapped eagerly). Each process
+//    keeps its VMAs in one page, sorted by address (see `k-vma.cc`).
+struct vmarea {
+    uintptr_t start_;
+    uintptr_t end_;
+    int perm_;                  // PTE_P | PTE_U, plus PTE_W if writable
+    int flags_;                 // VMA_ flags
+    const uint8_t* file_;       // VMA_FILE: file data for `start_`
+    uintptr_t file_end_;        // VMA_FILE: address where file data ends
+};
+#define VMA_ANON                0
+#define VMA_FILE                1
+#define VMA_SHARED              2
+#define VMA_SEQUENTIAL          4       // `sys_madvise(MADV_SEQUENTIAL)`
+#define NVMAS                   (PAGESIZE / sizeof(vmarea))
+
+// Shared memory segment attached to a process (see `k-shm.cc`).
+// `addr_ == 0` means the segment was created but is not yet mapped.
+struct shm_attachment {
+    uintptr_t addr_;
+    int id_;                    // -1 if unused
+};
+#define NSHMATTACH              4
+
+
+// System call table entry; see `proc::syscall_table`
+struct syscall_desc {
+    int nr_;                           // system call number
+    const char* name_;
+    int nargs_;                        // number of register arguments
+    int flags_;
+    uintptr_t (*fn_)(proc* p, regstate* regs);
+};
+#define SYSF_VMLOCK             1      // run with `proc::vmlock_` held
+#define SYSF_RING               2      // may be queued on a system call ring
 
 
 // Process descriptor type
@@ -72,13 +156,40 @@ struct __attribute__((aligned(4096))) proc {
     yieldstate* yields_;               // process's current yield state
 
     enum state_t {
-        blank = 0, runnable, blocked, broken
+        blank = 0, runnable, blocked, broken, exited
     };
     state_t state_;                    // process state
     x86_64_pagetable* pagetable_;      // process's page table
 
     proc** runq_pprev_;
     proc* runq_next_;
+    int cpu_;                          // index of home CPU
+    proc* wq_next_;                    // next process in `wait_queue`
+    uintptr_t wq_key_;                 // key for `wait_queue::wake_key`
+    unsigned long wq_deadline_;        // tick deadline for blocking, or 0
+    int wq_result_;                    // result set by waker
+    vmarea* vmas_;                     // page of sorted VMAs, or nullptr
+    int nvmas_;                        // # valid entries in `vmas_`
+    uintptr_t fault_next_;             // end of last fault-around window
+    unsigned fault_window_;            // # pages to map after next fault
+    unsigned long wss_tick_;           // tick of last working-set scan
+    wss_info wss_;                     // working-set estimates
+    mutex vmlock_;                     // held while changing `pagetable_`
+    uint64_t pcid_tag_[NCPU];          // per-CPU PCID and its generation
+    std::atomic<unsigned> active_cpus_; // mask of CPUs with `pagetable_`
+                                       // loaded
+    pid_t ppid_;                       // parent process ID, or 0
+    int exit_status_;                  // status passed to `sys_exit`
+    wait_queue waitq_;                 // parent waiting for a child to exit
+    shm_attachment shm_[NSHMATTACH];   // shared memory segments
+    kinfo_proc* kinfo_;                // kernel info page, or nullptr
+    sysring* ring_;                    // system call ring, or nullptr
+    uint32_t ring_sq_head_;            // kernel's copies of ring indexes
+    uint32_t ring_cq_tail_;
+    bool ring_poll_;                   // `ring_` is drained by `ringd`
+    x86_64_page* fpu_state_;           // saved FPU/SSE/AVX state, or
+                                       // nullptr if never used
+    rcu_head rcu_;                     // frees the proc after reaping
 
 
     proc() = default;
@@ -89,6 +200,7 @@ struct __attribute__((aligned(4096))) proc {
     void init_user(pid_t pid, x86_64_pagetable* pt);
     void init_kernel(pid_t pid, void (*f)(proc*));
     int load(const char* binary_name);
+    int map_kinfo();
 
     void exception(regstate* reg);
     uintptr_t syscall(regstate* reg);
@@ -96,14 +208,105 @@ struct __attribute__((aligned(4096))) proc {
     void yield();
     void yield_noreturn() __attribute__((noreturn));
     void resume() __attribute__((noreturn));
+    void wake();
+
+    int add_vma(uintptr_t start, uintptr_t end,
+                int perm = PTE_P | PTE_W | PTE_U, int flags = VMA_ANON,
+                const uint8_t* file = nullptr, uintptr_t file_end = 0);
+    vmarea* find_vma(uintptr_t va);
+    int remove_vmas(uintptr_t start, uintptr_t end);
+    int copy_vmas(proc* child);
+    void free_vmas();
+    bool handle_page_fault(uintptr_t addr, int err);
+    bool fault_in_write(uintptr_t addr);
+    int copy_to_user(uintptr_t addr, const void* src, size_t n);
+    void wss_scan();
+    int ring_drain(unsigned max);
+    void ring_free();
+    bool fpu_trap();
+    int fpu_fork(proc* child);
+    void fpu_free();
 
  private:
     int load_segment(const elf_program* ph, const uint8_t* data);
+    static const syscall_desc syscall_table[NSYSCALL];
+    static constexpr bool syscall_table_ok();
+    int syscall_page_alloc(uintptr_t addr);
+    int syscall_stats(uintptr_t addr);
+    int syscall_kstats(uintptr_t addr, size_t n);
+    pid_t syscall_fork(regstate* regs);
+    void syscall_exit(int status) __attribute__((noreturn));
+    pid_t syscall_waitpid(pid_t pid, uintptr_t status_addr, int options);
+    uintptr_t syscall_mmap(uintptr_t addr, size_t len, int perm, int flags,
+                           uintptr_t name_addr, size_t offset);
+    int syscall_munmap(uintptr_t addr, size_t len);
+    int syscall_mprotect(uintptr_t addr, size_t len, int perm);
+    int split_vma(uintptr_t va);
+    int syscall_madvise(uintptr_t addr, size_t len, int advice);
+    int syscall_getwss(pid_t pid, uintptr_t addr);
+    uintptr_t syscall_ring_setup(int flags);
+    int syscall_ring_enter(unsigned n);
+    int check_range(uintptr_t addr, uintptr_t end);
+    int fault_in(const vmarea* vma, uintptr_t va);
+    void fault_around(const vmarea* vma, uintptr_t va);
 };
 
 #define NPROC 16
 extern proc* ptable[NPROC];
 extern spinlock ptable_lock;
+
+
+// TLB shootdown
+//    A `tlb_batch` collects virtual address ranges whose mappings in
+//    process `p` changed. `flush()` (also run by the destructor)
+//    invalidates them on every CPU that might cache them: locally with
+//    `invlpg`, and on each CPU that has `p`'s page table loaded with one
+//    IPI per batch. Batches covering more than `full_threshold` pages, or
+//    more than `max_ranges` ranges, flush the whole address space. CPUs
+//    that are not running `p` just lose `p`'s PCID. Pages passed to
+//    `free_page()` are freed after the next flush, so no CPU can use a
+//    stale translation to a reallocated page. `flush()` waits for
+//    remote CPUs with interrupts disabled, so callers must not hold
+//    spinlocks a remote CPU might spin on.
+struct tlb_batch {
+    explicit tlb_batch(proc* p);
+    ~tlb_batch();
+    NO_COPY_OR_ASSIGN(tlb_batch);
+
+    void add(uintptr_t va, size_t sz = PAGESIZE);
+    void free_page(x86_64_page* pg);
+    void flush();
+
+    static constexpr unsigned max_ranges = 4;
+    static constexpr size_t full_threshold = 32;
+    static constexpr unsigned max_free = 16;
+
+ private:
+    proc* p_;
+    unsigned n_;
+    size_t npages_;
+    bool full_;
+    unsigned nfree_;
+    uintptr_t start_[max_ranges];
+    uintptr_t end_[max_ranges];
+    x86_64_page* free_[max_free];      // freed once the flush completes
+
+    void free_pages();
+};
+
+// handle TLB shootdowns queued for this CPU (interrupts must be disabled)
+void tlb_shootdown_handle();
+
+// ptable_lookup(pid)
+//    Return the process with ID `pid`, or nullptr. Must be called with
+//    `ptable_lock` held or within an RCU read-side critical section; in
+//    the latter case the result stays valid until `rcu_read_unlock()`.
+inline proc* ptable_lookup(pid_t pid) {
+    if (pid < 0 || pid >= NPROC) {
+        return nullptr;
+    }
+    return rcu_dereference(ptable[pid]);
+}
 #define KTASKSTACK_SIZE  4096
 
 
@@ -121,25 +324,116 @@ struct yieldstate {
 };
 
 
+// futexes
+
+// futex_wait(p, addr, expected, timeout)
+//    Block `p` while the user word at `addr` equals `expected`, for at
+//    most `timeout` ticks (0 means forever). Returns 0 when woken,
+//    E_AGAIN on value mismatch, or E_TIMEDOUT.
+int futex_wait(proc* p, uintptr_t addr, int expected, unsigned long timeout);
+
+// futex_wake(p, addr, n)
+//    Wake up to `n` processes waiting on the user word at `addr`.
+//    Returns the number woken.
+int futex_wake(proc* p, uintptr_t addr, int n);
+
+// futex_expire(now)
+//    Time out futex waiters whose deadlines have passed.
+void futex_expire(unsigned long now);
+
+// ksm_start()
+//    Start the page deduplication kernel task; see `k-ksm.cc`.
+void ksm_start();
+
+// ksm_expire(now)
+//    Wake the page deduplicator if its sleep has ended.
+void ksm_expire(unsigned long now);
+
+// ring_start()
+//    Start the system call ring polling kernel task; see `k-ring.cc`.
+void ring_start();
+
+// ring_expire(now)
+//    Wake the ring polling task if its sleep has ended.
+void ring_expire(unsigned long now);
+
+// shm_create(p, size), shm_map(p, id, addr, perm), shm_unmap(p, addr)
+//    Shared memory system calls; see `k-shm.cc` and `p-lib.hh`.
+int shm_create(proc* p, size_t size);
+int shm_map(proc* p, int id, uintptr_t addr, int perm);
+int shm_unmap(proc* p, uintptr_t addr);
+
+// shm_cancel(p, id)
+//    Destroy segment `id`, which `p` created but has not mapped.
+void shm_cancel(proc* p, int id);
+
+// shm_fork(p, child)
+//    Give `child` references to the segments mapped in `p`.
+void shm_fork(proc* p, proc* child);
+
+// shm_exit(p)
+//    Drop all of `p`'s segment references. `p`'s user pages, including
+//    segment mappings, must be freed separately.
+void shm_exit(proc* p);
+
+
 // timekeeping
 
 #define HZ 100                  // number of ticks per second
-extern unsigned long ticks;     // number of ticks since boot
+#define WSS_INTERVAL HZ         // ticks between a process's working-set scans
+
+struct ktime_snapshot {
+    unsigned long ticks;        // number of ticks since boot
+    uint64_t tsc_base;          // TSC at the most recent tick
+    uint64_t tsc_hz;            // estimated TSC frequency (0 if unknown)
+};
+
+// `timekeeper` maintains the kernel's notion of time. CPU 0 calls
+// `tick()` on every timer interrupt; any CPU may read a consistent
+// snapshot without taking a lock.
+class timekeeper {
+  public:
+    void tick();
+    inline ktime_snapshot snapshot() const;
+    inline unsigned long ticks() const;
+
+  private:
+    seqlock lock_;
+    ktime_snapshot t_;
+};
+
+extern timekeeper ktime;
+
+// kinfo_update_time(t)
+//    Publish time snapshot `t` on the user-visible time page.
+void kinfo_update_time(const ktime_snapshot& t);
 
 
 // Segment selectors
 #define SEGSEL_BOOT_CODE        0x8             // boot code segment
 #define SEGSEL_KERN_CODE        0x8             // kernel code segment
 #define SEGSEL_KERN_DATA        0x10            // kernel data segment
-#define SEGSEL_APP_CODE         0x18            // application code segment
-#define SEGSEL_APP_DATA         0x20            // application data segment
+// `sysretq` loads %ss and %cs from consecutive selectors, so application
+// data must directly precede application code
+#define SEGSEL_APP_DATA         0x18            // application data segment
+#define SEGSEL_APP_CODE         0x20            // application code segment
 #define SEGSEL_TASKSTATE        0x28            // task state segment
 
 
+// Software-defined page table entry bits (ignored by hardware)
+#define PTE_COW                 0x200UL         // copy-on-write page
+#define PTE_SHARED              0x400UL         // shared memory page
+
+
 // Physical memory size
 #define MEMSIZE_PHYSICAL        0x200000
 // Virtual memory size
 #define MEMSIZE_VIRTUAL         0x300000
+// Maximum size of a process's stack, which grows down from MEMSIZE_VIRTUAL
+#define USER_STACK_SIZE         0x10000
+// Highest address user mappings may cover; the kernel information pages
+// (see `lib.hh`) lie above
+#define VA_USERMAX              (KINFO_TIME_ADDR - 1)
 
 enum memtype_t {
     mem_nonexistent = 0, mem_available = 1, mem_kernel = 2, mem_reserved = 3,
@@ -154,6 +448,7 @@ extern memrangeset<16> physical_ranges;
 #define IRQ_KEYBOARD            1
 #define IRQ_IDE                 14
 #define IRQ_ERROR               19
+#define IRQ_TLBSHOOTDOWN        20      // inter-processor, see `tlb_batch`
 #define IRQ_SPURIOUS            31
 
 #define KTEXT_BASE              0xFFFFFFFF80000000UL
@@ -254,7 +549,7 @@ void timer_init(int rate);
 
 
 // kernel page table (used for virtual memory)
-extern x86_64_pagetable early_pagetable[2];
+extern x86_64_pagetable early_pagetable[3];
 
 // allocate and initialize a new page table
 x86_64_pagetable* kalloc_pagetable();
@@ -262,6 +557,14 @@ x86_64_pagetable* kalloc_pagetable();
 // change current page table
 void set_pagetable(x86_64_pagetable* pagetable);
 
+// process-context identifiers (PCIDs), used if the CPU supports them.
+// `early_pagetable` always uses PCID_KERNEL; other page tables installed
+// by `set_pagetable()` use PCID_SCRATCH and are flushed on every load;
+// `cpustate::load_pagetable()` hands out the rest to processes.
+extern bool pcid_enabled;
+#define PCID_KERNEL             0
+#define PCID_SCRATCH            0xFFF
+
 // turn off the virtual machine
 void poweroff() __attribute__((noreturn));
 
@@ -299,12 +602,23 @@ int keyboard_readc();
 #define KEY_DELETE      0311
 
 // check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
+//    Poll for the user typing a control key. 'a', 'f', and 'e' cause a soft
 //    reboot where the kernel runs the allocator programs, "fork", or
 //    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
-//    Returns key typed or -1 for no key.
+//    Returns key typed or -1 for no key. Use only with interrupts disabled.
 int check_keyboard();
 
+// keyboard_interrupt
+//    Handle an IRQ_KEYBOARD interrupt, including its acknowledgement.
+//    Control keys act as for `check_keyboard`; other keys are queued for
+//    `keyboard_getc`.
+void keyboard_interrupt();
+
+// keyboard_getc
+//    Return the oldest queued key, or -1 if there is none. Backs
+//    `sys_getc`.
+int keyboard_getc();
+
 
 // program_load(p, programnumber)
 //    Load the code corresponding to program `programnumber` into the process
@@ -314,8 +628,21 @@ int check_keyboard();
 //    `vm_map`.
 int program_load(proc* p, int programnumber);
 
+// flatfs_find(name, size)
+//    Return the contents of flatfs file `name`, which are page-aligned in
+//    the kernel image, and store its size in `*size`. Returns nullptr if
+//    there is no such file.
+const uint8_t* flatfs_find(const char* name, size_t* size);
+
+// kallocpage(), kfree(pg), kfree_pages(pgs, n), kincref(pg), krefcount(pg)
+//    Allocate a physical page with reference count 1; drop, add, or
+//    count references. `kfree_pages` drops references to `n` pages at
+//    once. See `k-alloc.cc`.
 x86_64_page* kallocpage();
-void kfree(x86_64_page*);
+void kfree(x86_64_page* pg);
+void kfree_pages(x86_64_page** pgs, size_t n);
+void kincref(x86_64_page* pg);
+unsigned krefcount(x86_64_page* pg);
 
 // log_printf, log_vprintf
 //    Print debugging messages to the host's `log.txt` file. We run QEMU
@@ -340,18 +667,87 @@ int error_vprintf(int cpos, int color, const char* format, va_list val)
     __attribute__((noinline));
 
 
+// this_cpu_read(member), this_cpu_add(member, delta)
+//    Access a member of the current CPU's `cpustate` with a single
+//    `%gs`-relative instruction. These need not disable interrupts:
+//    an interrupt cannot split the instruction, and a process's kernel
+//    stack never migrates to another CPU mid-instruction.
+#define this_cpu_read(member) \
+    percpu_read<decltype(cpustate::member), offsetof(cpustate, member)>()
+#define this_cpu_add(member, delta) \
+    percpu_add<decltype(cpustate::member), offsetof(cpustate, member)>((delta))
+
+// The offset is an immediate operand (`%c`), not a memory operand: a
+// memory operand would name an object at address `offset`, which the
+// compiler's bounds checks rightly reject.
+template <typename T, size_t offset>
+inline T percpu_read() {
+    T v;
+    asm volatile ("mov %%gs:%c1, %0" : "=r" (v) : "i" (offset));
+    return v;
+}
+
+template <typename T, size_t offset>
+inline void percpu_add(T delta) {
+    static_assert(sizeof(T) == 4 || sizeof(T) == 8, "bad per-CPU type");
+    if constexpr (sizeof(T) == 8) {
+        asm volatile ("addq %0, %%gs:%c1"
+                      : : "er" (delta), "i" (offset) : "cc", "memory");
+    } else {
+        asm volatile ("addl %0, %%gs:%c1"
+                      : : "er" (delta), "i" (offset) : "cc", "memory");
+    }
+}
+
 inline cpustate* this_cpu() {
     assert(is_cli());
-    cpustate* result;
-    asm volatile ("movq %%gs:(0), %0" : "=r" (result));
-    return result;
+    return this_cpu_read(self_);
+}
+
+inline proc* current() {
+    // Processes never migrate, so no need to disable interrupts
+    return this_cpu_read(current_);
 }
 
 inline void adjust_this_cpu_spinlock_depth(int delta) {
-    asm volatile ("addl %1, %%gs:%0"
-                  : "+m" (*reinterpret_cast<int*>
-                          (offsetof(cpustate, spinlock_depth_)))
-                  : "er" (delta) : "cc", "memory");
+    this_cpu_add(spinlock_depth_, unsigned(delta));
+}
+
+
+// kstat_add(stat, delta)
+//    Add `delta` to this CPU's shard of `stat`. Costs one non-atomic
+//    `%gs`-relative add.
+inline void kstat_add(kstat_t stat, uint64_t delta = 1) {
+    asm volatile ("addq %0, %%gs:%c1(,%2,8)"
+                  : : "er" (delta), "i" (offsetof(cpustate, kstats_)),
+                    "r" (uintptr_t(stat))
+                  : "cc", "memory");
+}
+
+// kstat_read(stat)
+//    Return the sum of `stat` over all CPUs. The sum is not a snapshot:
+//    it may miss increments that race with the read.
+inline uint64_t kstat_read(kstat_t stat) {
+    uint64_t sum = 0;
+    for (int i = 0; i < ncpu; ++i) {
+        sum += __atomic_load_n(&cpus[i].kstats_[stat], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+inline ktime_snapshot timekeeper::snapshot() const {
+    ktime_snapshot t;
+    unsigned seq;
+    do {
+        seq = lock_.read_begin();
+        t = t_;
+    } while (lock_.read_retry(seq));
+    return t;
+}
+
+inline unsigned long timekeeper::ticks() const {
+    // a single aligned word needs no retry loop
+    return __atomic_load_n(&t_.ticks, __ATOMIC_RELAXED);
 }
 
 inline bool cpustate::contains(void* ptr) const {
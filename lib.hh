@@ -74,6 +74,148 @@ void panic(const char* format, ...) __attribute__((noinline, noreturn));
 #define SYSCALL_PAGE_ALLOC      5
 #define SYSCALL_FORK            6
 #define SYSCALL_EXIT            7
+#define SYSCALL_FUTEX_WAIT      8
+#define SYSCALL_FUTEX_WAKE      9
+#define SYSCALL_WAITPID         10
+#define SYSCALL_SHM_CREATE      11
+#define SYSCALL_SHM_MAP         12
+#define SYSCALL_SHM_UNMAP       13
+#define SYSCALL_MMAP            14
+#define SYSCALL_MUNMAP          15
+#define SYSCALL_MPROTECT        16
+#define SYSCALL_MADVISE         17
+#define SYSCALL_GETWSS          18
+#define SYSCALL_RING_SETUP      19
+#define SYSCALL_RING_ENTER      20
+#define SYSCALL_STATS           21
+#define SYSCALL_KSTATS          22
+#define SYSCALL_GETC            23
+#define NSYSCALL                24      // one more than the largest number
+
+// sys_waitpid options
+#define W_NOHANG        1       // return E_AGAIN instead of blocking
+
+// sys_mmap flags
+#define MAP_SHARED      1       // share with `sys_fork` children
+#define MAP_PRIVATE     2       // copy on write
+#define MAP_ANONYMOUS   4       // zero-filled, not backed by a file
+#define MAP_FIXED       8       // map exactly at `addr`, replacing mappings
+
+// sys_getwss result: working-set estimates, in pages
+struct wss_info {
+    uint64_t resident;          // user pages mapped at the last scan
+    uint64_t accessed;          // pages accessed during the last interval
+    uint64_t dirtied;           // pages written during the last interval
+    uint64_t wss;               // working-set size, smoothed
+    uint64_t dirty_rate;        // pages written per second, smoothed
+    uint64_t scans;             // number of scans so far
+};
+
+// Kernel information pages
+//    The kernel maps two read-only pages at the top of every user address
+//    space. `kinfo_time`, shared by all processes, holds the time as of
+//    the last timer tick; the kernel makes `seq` odd while updating it.
+//    `kinfo_proc` describes the process that maps it. The `kinfo_`
+//    functions in `p-lib.hh` read them without a system call.
+#define KINFO_TIME_ADDR 0x7FFFFFFFE000UL
+#define KINFO_PROC_ADDR 0x7FFFFFFFF000UL
+
+struct kinfo_time {
+    uint32_t seq;               // odd while the kernel is updating
+    uint32_t hz;                // timer ticks per second
+    uint64_t ticks;             // ticks since boot
+    uint64_t tsc_base;          // TSC at the most recent tick
+    uint64_t tsc_hz;            // estimated TSC frequency (0 if unknown)
+};
+
+struct kinfo_proc {
+    pid_t pid;                  // process ID
+    pid_t ppid;                 // parent process ID, or 0
+    int cpu;                    // CPU the process last started running on
+    uint64_t runs;              // times the scheduler has run the process
+    uint64_t syscalls;          // system calls made
+};
+
+// sys_stats result: one entry per system call number
+#define SYSSTAT_NBUCKET 16
+struct syscall_stat {
+    uint64_t calls;             // calls made
+    uint64_t cycles;            // total cycles in calls that returned
+    uint64_t hist[SYSSTAT_NBUCKET]; // calls that returned, by duration:
+                                // `hist[0]` took under 128 cycles,
+                                // `hist[i]` under `128 << i`, and the
+                                // last bucket everything longer
+};
+
+// sys_kstats result: kernel event counters, summed over all CPUs and
+// indexed by `kstat_t`
+enum kstat_t {
+    kstat_syscalls,             // system calls
+    kstat_pagefaults,           // page faults
+    kstat_timer_interrupts,     // timer interrupts
+    kstat_context_switches,     // process resumptions by `schedule()`
+    kstat_tlb_shootdowns,       // `tlb_batch::flush()`es that sent IPIs
+    kstat_tlb_ipis,             // TLB shootdown IPIs sent
+    kstat_tlb_shootdown_cycles, // cycles senders waited for remote CPUs
+    kstat_faults_avoided,       // pages mapped by fault-around or prefault
+    kstat_ksm_scanned,          // pages examined by the page deduplicator
+    kstat_ksm_merged,           // pages merged into a shared copy
+    kstat_ksm_saved,            // pages currently saved by merging
+    kstat_ksm_cycles,           // cycles spent deduplicating
+    kstat_ring_ops,             // system calls run from rings
+    nkstat
+};
+
+// System call rings
+//    A `sysring` occupies one page shared between a process and the
+//    kernel. The process queues system calls in `sq` and advances
+//    `sq_tail`; the kernel runs them in order, advancing `sq_head`, and
+//    queues their results in `cq`, advancing `cq_tail`; the process
+//    consumes results by advancing `cq_head`. Indexes increase without
+//    bound and are reduced modulo the queue sizes. See `sys_ring_setup`.
+#define SYSRING_NSQE    32
+#define SYSRING_NCQE    64
+
+// sys_ring_setup flags
+#define SYSRING_POLL    1       // a kernel task drains the ring every tick
+
+struct sysring_sqe {
+    uint64_t op;                // SYSCALL_ number
+    uint64_t args[6];
+    uint64_t user_data;         // copied to the completion
+};
+
+struct sysring_cqe {
+    uint64_t user_data;
+    int64_t result;             // system call return value
+};
+
+struct sysring {
+    uint32_t sq_head;           // written by the kernel
+    uint32_t sq_tail;           // written by the process
+    uint32_t cq_head;           // written by the process
+    uint32_t cq_tail;           // written by the kernel
+    uint32_t flags;             // flags passed to `sys_ring_setup`
+    uint32_t padding[11];
+    sysring_sqe sq[SYSRING_NSQE];
+    sysring_cqe cq[SYSRING_NCQE];
+};
+
+// sys_madvise advice
+#define MADV_NORMAL     0       // no special treatment
+#define MADV_SEQUENTIAL 2       // expect sequential access; map far ahead
+#define MADV_WILLNEED   3       // expect access soon; map now
+#define MADV_DONTNEED   4       // drop pages; private pages refill on access
+
+
+// System call error codes (returned as negative numbers)
+
+#define E_CHILD         -10     // no such child process
+#define E_AGAIN         -11     // try again
+#define E_NOMEM         -12     // out of memory
+#define E_FAULT         -14     // bad address
+#define E_INVAL         -22     // invalid argument
+#define E_TIMEDOUT      -110    // timed out
 
 
 // Console printing
@@ -0,0 +1,53 @@
+#include "p-lib.hh"
+
+// p-bench-exit
+//
+//    Times process exit as seen by the parent: from a child's last
+//    instruction before `sys_exit` to the return of the parent's
+//    `sys_waitpid`, which reaps it. Before exiting, the child writes
+//    `npages` pages, giving it private copies for exit to free. The
+//    child records its `rdtsc()` in shared memory, so the latency spans
+//    CPUs when the child runs elsewhere; QEMU keeps their TSCs in step.
+
+#define ROUNDS          20
+#define MAXPAGES        64
+
+static const unsigned sizes[] = { 0, 16, 64 };
+
+void process_main(void) {
+    auto stamp = reinterpret_cast<volatile uint64_t*>(
+        sys_mmap(nullptr, PAGESIZE, PTE_P | PTE_W | PTE_U,
+                 MAP_SHARED | MAP_ANONYMOUS));
+    assert(intptr_t(stamp) >= 0);
+    auto heap = reinterpret_cast<volatile uint8_t*>(
+        sys_mmap(nullptr, MAXPAGES * PAGESIZE, PTE_P | PTE_W | PTE_U,
+                 MAP_PRIVATE | MAP_ANONYMOUS));
+    assert(intptr_t(heap) >= 0);
+    for (unsigned i = 0; i != MAXPAGES; ++i) {
+        heap[i * PAGESIZE] = i;
+    }
+
+    app_printf(0, "exit to reap (cycles, min/mean of %d)\n", ROUNDS);
+    for (unsigned npages : sizes) {
+        cycle_stats latency;
+        for (int i = 0; i != ROUNDS; ++i) {
+            pid_t p = sys_fork();
+            assert(p >= 0);
+            if (p == 0) {
+                for (unsigned j = 0; j != npages; ++j) {
+                    heap[j * PAGESIZE] = j + 1;
+                }
+                *stamp = rdtsc();
+                sys_exit(0);
+            }
+            pid_t w = sys_waitpid(p);
+            uint64_t t = rdtsc();
+            assert(w == p);
+            latency.add(t - *stamp);
+        }
+        app_printf(0, "%2u dirty pages: %lu/%lu\n",
+                   npages, latency.min_, latency.mean());
+    }
+    app_printf(0, "done\n");
+    sys_exit(0);
+}
@@ -0,0 +1,49 @@
+#include "p-lib.hh"
+
+// p-bench-fork
+//
+//    Times `sys_fork` as the parent's address space grows. Copy-on-write
+//    fork copies page tables, not pages, so its cost should grow with
+//    the number of mapped pages far more slowly than a copying fork's.
+//    For each size, reports the parent's `sys_fork` latency and the
+//    round trip through the child's exit and `sys_waitpid`.
+
+#define ROUNDS          20
+#define MAXPAGES        128
+
+static const unsigned sizes[] = { 0, 16, 64, 128 };
+
+void process_main(void) {
+    uint8_t* heap = reinterpret_cast<uint8_t*>(
+        sys_mmap(nullptr, MAXPAGES * PAGESIZE, PTE_P | PTE_W | PTE_U,
+                 MAP_PRIVATE | MAP_ANONYMOUS));
+    assert(intptr_t(heap) >= 0);
+
+    app_printf(0, "fork cost (cycles, min/mean of %d)\n", ROUNDS);
+    unsigned touched = 0;
+    for (unsigned npages : sizes) {
+        for (; touched != npages; ++touched) {
+            heap[touched * PAGESIZE] = touched;
+        }
+
+        cycle_stats fork, roundtrip;
+        for (int i = 0; i != ROUNDS; ++i) {
+            uint64_t t0 = rdtsc();
+            pid_t p = sys_fork();
+            if (p == 0) {
+                sys_exit(0);
+            }
+            uint64_t t1 = rdtsc();
+            assert(p > 0);
+            pid_t w = sys_waitpid(p);
+            assert(w == p);
+            fork.add(t1 - t0);
+            roundtrip.add(rdtsc() - t0);
+        }
+        app_printf(0, "%3u pages: fork %lu/%lu, fork+exit+wait %lu/%lu\n",
+                   npages, fork.min_, fork.mean(),
+                   roundtrip.min_, roundtrip.mean());
+    }
+    app_printf(0, "done\n");
+    sys_exit(0);
+}
@@ -0,0 +1,34 @@
+#include "p-lib.hh"
+
+// p-bench-getpid
+//
+//    Times the `sys_getpid` round trip, which returns with `sysretq`,
+//    against reading the process ID from the kernel information page,
+//    which never enters the kernel. Each sample is the mean over a batch
+//    of calls, so `rdtsc()` overhead is amortized.
+
+#define BATCH           1000
+#define ROUNDS          20
+
+void process_main(void) {
+    cycle_stats syscall, kinfo;
+    for (int i = 0; i != ROUNDS; ++i) {
+        uint64_t t0 = rdtsc();
+        for (int j = 0; j != BATCH; ++j) {
+            (void) sys_getpid();
+        }
+        uint64_t t1 = rdtsc();
+        for (int j = 0; j != BATCH; ++j) {
+            (void) kinfo_getpid();
+        }
+        uint64_t t2 = rdtsc();
+        syscall.add((t1 - t0) / BATCH);
+        kinfo.add((t2 - t1) / BATCH);
+    }
+
+    app_printf(0, "getpid (cycles per call, min/mean of %d)\n", ROUNDS);
+    app_printf(0, "sys_getpid   %lu/%lu\n", syscall.min_, syscall.mean());
+    app_printf(0, "kinfo_getpid %lu/%lu\n", kinfo.min_, kinfo.mean());
+    app_printf(0, "done\n");
+    sys_exit(0);
+}
@@ -0,0 +1,74 @@
+#include "p-lib.hh"
+
+// p-bench-ksm
+//
+//    Measures same-page merging. Fills a mapping with pages that are
+//    identical in pairs plus some unique pages, then waits while `ksmd`
+//    scans, and reports pages scanned, merged, and saved, and the
+//    deduplicator's cycles per scanned page, from `sys_kstats`. Then
+//    checks every page's contents and times the copy-on-write faults
+//    that break sharing when the merged pages are written.
+
+#define NPAGES          64      // the first half holds repeated contents
+#define WAIT_SECONDS    3
+
+static uint64_t page_value(unsigned i) {
+    return i < NPAGES / 2 ? 0x5A5A0000 + i % 4 : 0xC0DE0000 + i;
+}
+
+void process_main(void) {
+    auto m = reinterpret_cast<volatile uint64_t*>(
+        sys_mmap(nullptr, NPAGES * PAGESIZE, PTE_P | PTE_W | PTE_U,
+                 MAP_PRIVATE | MAP_ANONYMOUS));
+    assert(intptr_t(m) >= 0);
+    size_t words = PAGESIZE / sizeof(uint64_t);
+
+    uint64_t before[nkstat], after[nkstat];
+    sys_kstats(before, nkstat);
+    for (unsigned i = 0; i != NPAGES; ++i) {
+        for (size_t w = 0; w != words; ++w) {
+            m[i * words + w] = page_value(i);
+        }
+    }
+
+    // wait for `ksmd` passes, stopping once every duplicate is merged
+    kinfo_time t;
+    kinfo_gettime(&t);
+    uint64_t deadline = kinfo_ticks() + WAIT_SECONDS * t.hz;
+    do {
+        sys_yield();
+        sys_kstats(after, nkstat);
+    } while (after[kstat_ksm_merged] - before[kstat_ksm_merged]
+             < NPAGES / 2 - 4
+             && kinfo_ticks() < deadline);
+
+    uint64_t scanned = after[kstat_ksm_scanned] - before[kstat_ksm_scanned];
+    uint64_t cycles = after[kstat_ksm_cycles] - before[kstat_ksm_cycles];
+    app_printf(0, "same-page merging over %d pages\n", NPAGES);
+    app_printf(0, "scanned %lu, merged %lu, saved now %lu\n", scanned,
+               after[kstat_ksm_merged] - before[kstat_ksm_merged],
+               after[kstat_ksm_saved]);
+    app_printf(0, "ksmd %lu cycles, %lu per scanned page\n",
+               cycles, scanned ? cycles / scanned : 0);
+
+    for (unsigned i = 0; i != NPAGES; ++i) {
+        for (size_t w = 0; w != words; ++w) {
+            assert(m[i * words + w] == page_value(i));
+        }
+    }
+
+    cycle_stats cow;
+    for (unsigned i = 0; i != NPAGES / 2; ++i) {
+        uint64_t t0 = rdtsc();
+        m[i * words] = ~page_value(i);
+        cow.add(rdtsc() - t0);
+    }
+    for (unsigned i = 0; i != NPAGES / 2; ++i) {
+        assert(m[i * words] == ~page_value(i));
+        assert(m[i * words + 1] == page_value(i));
+    }
+    app_printf(0, "first write %lu/%lu cycles (min/mean)\n",
+               cow.min_, cow.mean());
+    app_printf(0, "done\n");
+    sys_exit(0);
+}
@@ -0,0 +1,50 @@
+#include "p-lib.hh"
+
+// p-bench-range
+//
+//    Times the system calls built on the kernel's range page-table
+//    operations: `sys_madvise(MADV_WILLNEED)` populating a mapping,
+//    `sys_mprotect` there and back, and `sys_munmap`. Each runs over the
+//    whole range with one TLB batch, so its cost per page should fall
+//    as the range grows.
+
+#define ROUNDS          10
+
+static const unsigned sizes[] = { 1, 8, 32, 128 };
+
+void process_main(void) {
+    app_printf(0, "range ops (cycles, min of %d)\n", ROUNDS);
+    app_printf(0, "pages   populate   protect     unmap\n");
+    for (unsigned npages : sizes) {
+        size_t len = npages * PAGESIZE;
+        cycle_stats populate, protect, unmap;
+        for (int i = 0; i != ROUNDS; ++i) {
+            void* m = sys_mmap(nullptr, len, PTE_P | PTE_W | PTE_U,
+                               MAP_PRIVATE | MAP_ANONYMOUS);
+            assert(intptr_t(m) >= 0);
+
+            uint64_t t0 = rdtsc();
+            int r = sys_madvise(m, len, MADV_WILLNEED);
+            uint64_t t1 = rdtsc();
+            assert(r >= 0);
+            populate.add(t1 - t0);
+
+            t0 = rdtsc();
+            r = sys_mprotect(m, len, PTE_P | PTE_U);
+            int r2 = sys_mprotect(m, len, PTE_P | PTE_W | PTE_U);
+            t1 = rdtsc();
+            assert(r >= 0 && r2 >= 0);
+            protect.add((t1 - t0) / 2);
+
+            t0 = rdtsc();
+            r = sys_munmap(m, len);
+            t1 = rdtsc();
+            assert(r >= 0);
+            unmap.add(t1 - t0);
+        }
+        app_printf(0, "%5u %10lu %9lu %9lu\n", npages,
+                   populate.min_, protect.min_, unmap.min_);
+    }
+    app_printf(0, "done\n");
+    sys_exit(0);
+}
@@ -0,0 +1,64 @@
+#include "p-lib.hh"
+
+// p-bench-stream
+//
+//    Streams through a large anonymous mapping, reading one word per
+//    cache line, and reports cycles per page. The first pass includes
+//    demand-zero faults, so it is timed with each `sys_madvise` policy;
+//    later passes run on a populated mapping, where fewer, larger TLB
+//    entries pay off if the kernel managed to promote it to 2MiB pages.
+
+#define NPAGES          128
+#define PASSES          5
+
+static const char* const policy_names[] = {
+    "normal", "sequential", "willneed"
+};
+static const int policies[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_WILLNEED };
+
+
+// stream(p)
+//    Read every cache line of `[p, p + NPAGES * PAGESIZE)` and return the
+//    cycles taken.
+
+static uint64_t stream(const volatile uint64_t* p) {
+    uint64_t sum = 0;
+    uint64_t t0 = rdtsc();
+    for (size_t i = 0; i != NPAGES * PAGESIZE / sizeof(*p); i += 8) {
+        sum += p[i];
+    }
+    uint64_t t1 = rdtsc();
+    (void) sum;
+    return t1 - t0;
+}
+
+void process_main(void) {
+    size_t len = NPAGES * PAGESIZE;
+    app_printf(0, "streaming %d pages (cycles/page)\n", NPAGES);
+
+    for (size_t i = 0; i != arraysize(policies); ++i) {
+        void* m = sys_mmap(nullptr, len, PTE_P | PTE_W | PTE_U,
+                           MAP_PRIVATE | MAP_ANONYMOUS);
+        assert(intptr_t(m) >= 0);
+        auto p = reinterpret_cast<volatile uint64_t*>(m);
+
+        uint64_t t0 = rdtsc();
+        int r = sys_madvise(m, len, policies[i]);
+        assert(r >= 0);
+        stream(p);
+        uint64_t cold = rdtsc() - t0;
+
+        cycle_stats warm;
+        for (int pass = 0; pass != PASSES; ++pass) {
+            warm.add(stream(p));
+        }
+        app_printf(0, "%-10s first pass %lu, warm %lu/%lu (min/mean)\n",
+                   policy_names[i], cold / NPAGES,
+                   warm.min_ / NPAGES, warm.mean() / NPAGES);
+
+        r = sys_munmap(m, len);
+        assert(r >= 0);
+    }
+    app_printf(0, "done\n");
+    sys_exit(0);
+}
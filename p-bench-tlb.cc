@@ -0,0 +1,91 @@
+#include "p-lib.hh"
+
+// p-bench-tlb
+//
+//    Measures TLB shootdowns. A process's page table is only changed
+//    from another CPU by kernel tasks, so the benchmark queues
+//    `sys_mprotect` calls on a polled system call ring and spins in user
+//    mode until `ringd` runs them. Each call changes mappings that this
+//    CPU caches, so `ringd` must interrupt it. Reports the shootdown,
+//    IPI, and wait-cycle counters from `sys_kstats`.
+//
+//    `ringd` runs on one CPU, so a process on that CPU sees no
+//    shootdowns; the benchmark forks until a child runs elsewhere.
+
+#define ROUNDS          50
+#define NPAGES          8
+#define ATTEMPTS        4
+
+
+// measure()
+//    Run the benchmark in this process. Returns false if no shootdowns
+//    were needed, meaning this process shares `ringd`'s CPU.
+
+static bool measure() {
+    sysring* ring = sys_ring_setup(SYSRING_POLL);
+    assert(ring);
+    size_t len = NPAGES * PAGESIZE;
+    auto m = reinterpret_cast<volatile uint8_t*>(
+        sys_mmap(nullptr, len, PTE_P | PTE_W | PTE_U,
+                 MAP_PRIVATE | MAP_ANONYMOUS));
+    assert(intptr_t(m) >= 0);
+    for (unsigned i = 0; i != NPAGES; ++i) {
+        m[i * PAGESIZE] = i;
+    }
+
+    uint64_t before[nkstat], after[nkstat];
+    sys_kstats(before, nkstat);
+    cycle_stats roundtrip;
+    for (int i = 0; i != ROUNDS; ++i) {
+        int perm = i % 2 ? PTE_P | PTE_W | PTE_U : PTE_P | PTE_U;
+        uint64_t t0 = rdtsc();
+        bool ok = sysring_push(ring, SYSCALL_MPROTECT,
+                               reinterpret_cast<uintptr_t>(m), len, perm);
+        assert(ok);
+        // keep the mappings in this CPU's TLB until `ringd` gets here
+        sysring_cqe cqe;
+        while (!sysring_pop(ring, &cqe)) {
+            for (unsigned j = 0; j != NPAGES; ++j) {
+                (void) m[j * PAGESIZE];
+            }
+        }
+        roundtrip.add(rdtsc() - t0);
+        assert(cqe.result >= 0);
+    }
+    sys_kstats(after, nkstat);
+
+    uint64_t shootdowns = after[kstat_tlb_shootdowns]
+        - before[kstat_tlb_shootdowns];
+    if (shootdowns == 0) {
+        return false;
+    }
+    uint64_t ipis = after[kstat_tlb_ipis] - before[kstat_tlb_ipis];
+    uint64_t cycles = after[kstat_tlb_shootdown_cycles]
+        - before[kstat_tlb_shootdown_cycles];
+    app_printf(0, "TLB shootdowns from %d ring mprotects (CPU %d)\n",
+               ROUNDS, kinfo_getcpu());
+    app_printf(0, "shootdowns %lu, IPIs %lu, wait %lu cycles/shootdown\n",
+               shootdowns, ipis, cycles / shootdowns);
+    app_printf(0, "queue-to-completion %lu/%lu cycles (min/mean)\n",
+               roundtrip.min_, roundtrip.mean());
+    return true;
+}
+
+void process_main(void) {
+    for (int i = 0; i != ATTEMPTS; ++i) {
+        pid_t p = sys_fork();
+        assert(p >= 0);
+        if (p == 0) {
+            sys_exit(measure() ? 0 : 1);
+        }
+        int status;
+        pid_t w = sys_waitpid(p, &status);
+        assert(w == p);
+        if (status == 0) {
+            app_printf(0, "done\n");
+            sys_exit(0);
+        }
+    }
+    app_printf(0, "no shootdowns: every child shared ringd's CPU\n");
+    sys_exit(0);
+}
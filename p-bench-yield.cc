@@ -0,0 +1,99 @@
+#include "p-lib.hh"
+
+// p-bench-yield
+//
+//    Times `sys_yield` ping-pong between two processes on the same CPU.
+//    Each round trip is two context switches, each of which loads the
+//    other process's page table; with PCIDs, each process's TLB entries
+//    survive the other's turn. Both processes touch `npages` pages per
+//    turn, so larger working sets show the cost of any refills. The
+//    solo rows yield with no other process on the CPU.
+
+#define ROUNDS          2000
+#define MAXPAGES        32
+
+static const unsigned sizes[] = { 0, 8, 32 };
+
+struct shared_state {
+    std::atomic<int> child_cpu;
+    std::atomic<int> npages;
+    std::atomic<int> stop;
+};
+
+
+// touch(p, npages)
+//    Read one word from each of `npages` pages starting at `p`.
+
+static void touch(const volatile uint8_t* p, unsigned npages) {
+    for (unsigned i = 0; i != npages; ++i) {
+        (void) p[i * PAGESIZE];
+    }
+}
+
+// run(p, npages)
+//    Return the mean cycles per round of touching `npages` pages and
+//    yielding.
+
+static uint64_t run(const volatile uint8_t* p, unsigned npages) {
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i != ROUNDS; ++i) {
+        touch(p, npages);
+        sys_yield();
+    }
+    return (rdtsc() - t0) / ROUNDS;
+}
+
+void process_main(void) {
+    auto ss = reinterpret_cast<shared_state*>(
+        sys_mmap(nullptr, PAGESIZE, PTE_P | PTE_W | PTE_U,
+                 MAP_SHARED | MAP_ANONYMOUS));
+    assert(intptr_t(ss) >= 0);
+    auto heap = reinterpret_cast<volatile uint8_t*>(
+        sys_mmap(nullptr, MAXPAGES * PAGESIZE, PTE_P | PTE_W | PTE_U,
+                 MAP_PRIVATE | MAP_ANONYMOUS));
+    assert(intptr_t(heap) >= 0);
+    for (unsigned i = 0; i != MAXPAGES; ++i) {
+        heap[i * PAGESIZE] = i;
+    }
+
+    app_printf(0, "yield (cycles per round, mean of %d)\n", ROUNDS);
+    for (unsigned npages : sizes) {
+        app_printf(0, "solo     %2u pages: %lu\n", npages, run(heap, npages));
+    }
+
+    // processes stay on CPU `pid % ncpu`: fork until a child shares ours
+    int cpu = kinfo_getcpu();
+    pid_t child;
+    while (1) {
+        ss->child_cpu = -1;
+        child = sys_fork();
+        assert(child >= 0);
+        if (child == 0) {
+            ss->child_cpu = kinfo_getcpu();
+            if (ss->child_cpu != cpu) {
+                sys_exit(1);
+            }
+            while (!ss->stop) {
+                touch(heap, ss->npages);
+                sys_yield();
+            }
+            sys_exit(0);
+        }
+        while (ss->child_cpu == -1) {
+            sys_yield();
+        }
+        if (ss->child_cpu == cpu) {
+            break;
+        }
+        sys_waitpid(child);
+    }
+
+    for (unsigned npages : sizes) {
+        ss->npages = npages;
+        app_printf(0, "pingpong %2u pages: %lu\n", npages, run(heap, npages));
+    }
+    ss->stop = 1;
+    sys_waitpid(child);
+    app_printf(0, "done\n");
+    sys_exit(0);
+}
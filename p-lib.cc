@@ -23,6 +23,31 @@ void app_printf(int colorid, const char* format, ...) {
 }
 
 
+// umutex::lock, umutex::unlock
+//     Futex-based mutex (see Drepper, "Futexes Are Tricky").
+
+void umutex::lock() {
+    int c = 0;
+    if (v_.compare_exchange_strong(c, 1)) {
+        return;
+    }
+    // mark contended, then sleep until the holder wakes us
+    if (c != 2) {
+        c = v_.exchange(2);
+    }
+    while (c != 0) {
+        sys_futex_wait(&v_, 2);
+        c = v_.exchange(2);
+    }
+}
+
+void umutex::unlock() {
+    if (v_.exchange(0) == 2) {
+        sys_futex_wake(&v_, 1);
+    }
+}
+
+
 // panic, assert_fail
 //     Call the SYSCALL_PANIC system call so the kernel loops until Control-C.
 
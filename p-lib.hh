@@ -1,5 +1,6 @@
 #ifndef CHICKADEE_P_LIB_H
 #define CHICKADEE_P_LIB_H
+#include <atomic>
 #include "lib.hh"
 #include "x86-64.h"
 #if CHICKADEE_KERNEL
@@ -34,6 +35,49 @@ inline uintptr_t syscall0(int syscallno, uintptr_t arg0) {
     return rax;
 }
 
+inline uintptr_t syscall0(int syscallno, uintptr_t arg0, uintptr_t arg1) {
+    register uintptr_t rax asm("rax") = syscallno;
+    register uintptr_t rdi asm("rdi") = arg0;
+    register uintptr_t rsi asm("rsi") = arg1;
+    asm volatile ("syscall"
+                  : "+a" (rax), "+D" (rdi), "+S" (rsi)
+                  :
+                  : "cc", "rcx", "rdx",
+                    "r8", "r9", "r10", "r11", "memory");
+    return rax;
+}
+
+inline uintptr_t syscall0(int syscallno, uintptr_t arg0, uintptr_t arg1,
+                          uintptr_t arg2) {
+    register uintptr_t rax asm("rax") = syscallno;
+    register uintptr_t rdi asm("rdi") = arg0;
+    register uintptr_t rsi asm("rsi") = arg1;
+    register uintptr_t rdx asm("rdx") = arg2;
+    asm volatile ("syscall"
+                  : "+a" (rax), "+D" (rdi), "+S" (rsi), "+d" (rdx)
+                  :
+                  : "cc", "rcx", "r8", "r9", "r10", "r11", "memory");
+    return rax;
+}
+
+inline uintptr_t syscall0(int syscallno, uintptr_t arg0, uintptr_t arg1,
+                          uintptr_t arg2, uintptr_t arg3, uintptr_t arg4,
+                          uintptr_t arg5) {
+    register uintptr_t rax asm("rax") = syscallno;
+    register uintptr_t rdi asm("rdi") = arg0;
+    register uintptr_t rsi asm("rsi") = arg1;
+    register uintptr_t rdx asm("rdx") = arg2;
+    register uintptr_t r10 asm("r10") = arg3;
+    register uintptr_t r8 asm("r8") = arg4;
+    register uintptr_t r9 asm("r9") = arg5;
+    asm volatile ("syscall"
+                  : "+a" (rax), "+D" (rdi), "+S" (rsi), "+d" (rdx),
+                    "+r" (r10), "+r" (r8), "+r" (r9)
+                  :
+                  : "cc", "rcx", "r11", "memory");
+    return rax;
+}
+
 // sys_getpid
 //    Return current process ID.
 static inline pid_t sys_getpid(void) {
@@ -62,19 +106,269 @@ static inline pid_t sys_fork(void) {
     return syscall0(SYSCALL_FORK);
 }
 
-// sys_exit()
-//    Exit this process. Does not return.
-static inline void sys_exit(void) __attribute__((noreturn));
-static inline void sys_exit(void) {
-    syscall0(SYSCALL_EXIT);
+// sys_exit(status)
+//    Exit this process with exit status `status`. Does not return.
+static inline void sys_exit(int status = 0) __attribute__((noreturn));
+static inline void sys_exit(int status) {
+    syscall0(SYSCALL_EXIT, status);
     while (1) {
     }
 }
 
+// sys_waitpid(pid, status, options)
+//    Wait for child process `pid` (or any child, if `pid == 0`) to exit
+//    and reap it. Returns its process ID and stores its exit status in
+//    `*status` if `status != nullptr`. Returns E_CHILD if there is no
+//    such child, and E_AGAIN if `options` contains W_NOHANG and no
+//    matching child has exited yet.
+static inline pid_t sys_waitpid(pid_t pid, int* status = nullptr,
+                                int options = 0) {
+    return syscall0(SYSCALL_WAITPID, pid,
+                    reinterpret_cast<uintptr_t>(status), options);
+}
+
+// sys_shm_create(size)
+//    Create a shared memory segment of `size` bytes (rounded up to whole
+//    pages), initially zero. Returns its ID, or a negative error. The
+//    segment is destroyed once it has been unmapped by every process
+//    that mapped it (or when its creator exits without mapping it).
+static inline int sys_shm_create(size_t size) {
+    return syscall0(SYSCALL_SHM_CREATE, size);
+}
+
+// sys_shm_map(id, addr, perm)
+//    Map shared memory segment `id` at page-aligned address `addr` with
+//    permissions `perm` (PTE_P | PTE_U, plus PTE_W for write access).
+//    The range must not already be mapped. Mappings are inherited by
+//    `sys_fork()` children and stay shared. Returns 0 or negative.
+static inline int sys_shm_map(int id, void* addr,
+                              int perm = PTE_P | PTE_W | PTE_U) {
+    return syscall0(SYSCALL_SHM_MAP, id, reinterpret_cast<uintptr_t>(addr),
+                    perm);
+}
+
+// sys_shm_unmap(addr)
+//    Unmap the shared memory segment mapped at `addr`.
+static inline int sys_shm_unmap(void* addr) {
+    return syscall0(SYSCALL_SHM_UNMAP, reinterpret_cast<uintptr_t>(addr));
+}
+
+// sys_mmap(addr, len, perm, flags, file, offset)
+//    Map `len` bytes (rounded up to whole pages) with permissions `perm`
+//    (PTE_P | PTE_U, plus PTE_W for write access). `flags` contains
+//    MAP_SHARED or MAP_PRIVATE, and MAP_ANONYMOUS for zero-filled memory;
+//    otherwise the mapping shows flatfs file `file` starting at
+//    page-aligned `offset`, and reads as 0 past the file's end. Shared
+//    file mappings must be read-only. With MAP_FIXED the mapping goes at
+//    `addr`, replacing what was there; otherwise `addr` is a hint.
+//    Pages are populated on first access, except shared anonymous
+//    memory, which is a shared memory segment. Returns the mapping's
+//    address, or a negative error cast to a pointer.
+static inline void* sys_mmap(void* addr, size_t len, int perm, int flags,
+                             const char* file = nullptr, size_t offset = 0) {
+    return reinterpret_cast<void*>(
+        syscall0(SYSCALL_MMAP, reinterpret_cast<uintptr_t>(addr), len, perm,
+                 flags, reinterpret_cast<uintptr_t>(file), offset));
+}
+
+// sys_munmap(addr, len)
+//    Unmap the pages in `[addr, addr + len)`. Shared anonymous mappings
+//    must be unmapped whole. Returns 0 or negative.
+static inline int sys_munmap(void* addr, size_t len) {
+    return syscall0(SYSCALL_MUNMAP, reinterpret_cast<uintptr_t>(addr), len);
+}
+
+// sys_mprotect(addr, len, perm)
+//    Change the permissions of mapped range `[addr, addr + len)` to
+//    `perm`. Returns 0, E_NOMEM if part of the range is not mapped, or
+//    another negative error.
+static inline int sys_mprotect(void* addr, size_t len, int perm) {
+    return syscall0(SYSCALL_MPROTECT, reinterpret_cast<uintptr_t>(addr), len,
+                    perm);
+}
+
+// sys_madvise(addr, len, advice)
+//    Advise the kernel how `[addr, addr + len)` will be used (MADV_NORMAL,
+//    MADV_SEQUENTIAL, MADV_WILLNEED, or MADV_DONTNEED). DONTNEED drops
+//    private pages: anonymous memory reads as zero afterwards and file
+//    mappings reread the file. Returns 0 or negative.
+static inline int sys_madvise(void* addr, size_t len, int advice) {
+    return syscall0(SYSCALL_MADVISE, reinterpret_cast<uintptr_t>(addr), len,
+                    advice);
+}
+
+// sys_getwss(pid, info)
+//    Store the working-set estimates of process `pid` (or of this
+//    process, if `pid == 0`) in `*info`. Estimates are refreshed about
+//    once a second while the process runs, and decay while it is blocked.
+//    Returns 0 or negative.
+static inline int sys_getwss(pid_t pid, wss_info* info) {
+    return syscall0(SYSCALL_GETWSS, pid, reinterpret_cast<uintptr_t>(info));
+}
+
+
+// kinfo_getpid(), kinfo_getppid(), kinfo_getcpu()
+//    Return this process's ID, its parent's ID, or the CPU it is running
+//    on, read from the kernel information page. The CPU can change as
+//    soon as this returns.
+static inline pid_t kinfo_getpid() {
+    return reinterpret_cast<const volatile kinfo_proc*>(KINFO_PROC_ADDR)->pid;
+}
+static inline pid_t kinfo_getppid() {
+    return reinterpret_cast<const volatile kinfo_proc*>(KINFO_PROC_ADDR)->ppid;
+}
+static inline int kinfo_getcpu() {
+    return reinterpret_cast<const volatile kinfo_proc*>(KINFO_PROC_ADDR)->cpu;
+}
+
+// kinfo_gettime(t)
+//    Store a consistent copy of the kernel's time page in `*t`.
+static inline void kinfo_gettime(kinfo_time* t) {
+    auto kt = reinterpret_cast<const kinfo_time*>(KINFO_TIME_ADDR);
+    uint32_t seq;
+    do {
+        while ((seq = __atomic_load_n(&kt->seq, __ATOMIC_ACQUIRE)) & 1) {
+            pause();
+        }
+        t->hz = __atomic_load_n(&kt->hz, __ATOMIC_RELAXED);
+        t->ticks = __atomic_load_n(&kt->ticks, __ATOMIC_RELAXED);
+        t->tsc_base = __atomic_load_n(&kt->tsc_base, __ATOMIC_RELAXED);
+        t->tsc_hz = __atomic_load_n(&kt->tsc_hz, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&kt->seq, __ATOMIC_RELAXED) != seq);
+    t->seq = seq;
+}
+
+// kinfo_ticks()
+//    Return the number of timer ticks since boot.
+static inline uint64_t kinfo_ticks() {
+    auto kt = reinterpret_cast<const kinfo_time*>(KINFO_TIME_ADDR);
+    return __atomic_load_n(&kt->ticks, __ATOMIC_RELAXED);
+}
+
+// kinfo_nsec()
+//    Return nanoseconds since boot, interpolated from the TSC between
+//    ticks.
+static inline uint64_t kinfo_nsec() {
+    kinfo_time t;
+    kinfo_gettime(&t);
+    if (t.hz == 0) {
+        return 0;               // no tick yet
+    }
+    uint64_t ns = t.ticks * (1000000000UL / t.hz);
+    uint64_t tsc = rdtsc();
+    if (t.tsc_hz && tsc > t.tsc_base) {
+        ns += (tsc - t.tsc_base) * 1000000000UL / t.tsc_hz;
+    }
+    return ns;
+}
+
+// sys_ring_setup(flags)
+//    Create this process's system call ring and return its address, or
+//    nullptr on failure (for instance, if the process already has one).
+//    The ring is a `MAP_SHARED` mapping, so `sys_fork` children share it,
+//    but only this process can enter it. With `SYSRING_POLL`, a kernel
+//    task also drains the ring about every tick, so queued calls run
+//    without `sys_ring_enter`. Only calls that cannot block may be
+//    queued: page allocation, memory mapping, shared memory mapping,
+//    `getpid`, `getwss`, and `futex_wake`; others complete with E_INVAL.
+static inline sysring* sys_ring_setup(int flags) {
+    intptr_t r = syscall0(SYSCALL_RING_SETUP, flags);
+    return r < 0 ? nullptr : reinterpret_cast<sysring*>(r);
+}
+
+// sys_ring_enter(n)
+//    Run up to `n` queued system calls, or all of them if `n == 0`.
+//    Stops early if the completion queue fills. Returns the number run.
+static inline int sys_ring_enter(unsigned n) {
+    return syscall0(SYSCALL_RING_ENTER, n);
+}
+
+// sysring_push(ring, op, a0, a1, a2, a3, a4, a5, user_data)
+//    Queue system call `op` on `ring`. Returns false if the submission
+//    queue is full.
+static inline bool sysring_push(sysring* ring, int op,
+                                uintptr_t a0 = 0, uintptr_t a1 = 0,
+                                uintptr_t a2 = 0, uintptr_t a3 = 0,
+                                uintptr_t a4 = 0, uintptr_t a5 = 0,
+                                uint64_t user_data = 0) {
+    uint32_t tail = ring->sq_tail;
+    if (tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE)
+        == SYSRING_NSQE) {
+        return false;
+    }
+    sysring_sqe* sqe = &ring->sq[tail % SYSRING_NSQE];
+    sqe->op = op;
+    sqe->args[0] = a0;
+    sqe->args[1] = a1;
+    sqe->args[2] = a2;
+    sqe->args[3] = a3;
+    sqe->args[4] = a4;
+    sqe->args[5] = a5;
+    sqe->user_data = user_data;
+    __atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// sysring_pop(ring, cqe)
+//    Move the oldest completion on `ring` into `*cqe`. Returns false if
+//    there is none.
+static inline bool sysring_pop(sysring* ring, sysring_cqe* cqe) {
+    uint32_t head = ring->cq_head;
+    if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = ring->cq[head % SYSRING_NCQE];
+    __atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// sys_stats(stats)
+//    Store per-system-call counts and cycle histograms, summed over all
+//    CPUs, in `stats[0..NSYSCALL)`, indexed by system call number. If
+//    `stats == nullptr`, write a summary to the kernel log instead.
+//    Returns 0 or negative.
+static inline int sys_stats(syscall_stat* stats) {
+    return syscall0(SYSCALL_STATS, reinterpret_cast<uintptr_t>(stats));
+}
+
+// sys_kstats(stats, n)
+//    Store the first `n` kernel event counters, summed over all CPUs, in
+//    `stats[0..n)`, indexed by `kstat_t`. If `stats == nullptr`, write
+//    them all to the kernel log instead. Returns the number of counters
+//    the kernel keeps, or negative.
+static inline int sys_kstats(uint64_t* stats, size_t n) {
+    return syscall0(SYSCALL_KSTATS, reinterpret_cast<uintptr_t>(stats), n);
+}
+
+// sys_getc()
+//    Return the oldest key typed at the keyboard and not yet read, or
+//    E_AGAIN if there is none. Does not block.
+static inline int sys_getc() {
+    return syscall0(SYSCALL_GETC);
+}
+
 static inline void sys_pause() {
     syscall0(SYSCALL_PAUSE);
 }
 
+// sys_futex_wait(addr, expected, timeout)
+//    Block while `*addr == expected`, for at most `timeout` ticks
+//    (0 means forever). Returns 0 when woken by `sys_futex_wake`,
+//    E_AGAIN if `*addr != expected`, or E_TIMEDOUT.
+static inline int sys_futex_wait(std::atomic<int>* addr, int expected,
+                                 unsigned long timeout = 0) {
+    return syscall0(SYSCALL_FUTEX_WAIT, reinterpret_cast<uintptr_t>(addr),
+                    expected, timeout);
+}
+
+// sys_futex_wake(addr, n)
+//    Wake up to `n` processes blocked in `sys_futex_wait(addr, ...)`.
+//    Returns the number of processes woken.
+static inline int sys_futex_wake(std::atomic<int>* addr, int n) {
+    return syscall0(SYSCALL_FUTEX_WAKE, reinterpret_cast<uintptr_t>(addr), n);
+}
+
 // sys_panic(msg)
 //    Panic.
 static inline pid_t __attribute__((noreturn)) sys_panic(const char* msg) {
@@ -86,6 +380,37 @@ static inline pid_t __attribute__((noreturn)) sys_panic(const char* msg) {
 
 // OTHER HELPER FUNCTIONS
 
+// umutex
+//    A mutex for processes that share memory, built on futexes. The
+//    uncontended paths never enter the kernel.
+struct umutex {
+    std::atomic<int> v_;        // 0 unlocked, 1 locked, 2 contended
+
+    void lock();
+    bool try_lock() {
+        int expected = 0;
+        return v_.compare_exchange_strong(expected, 1);
+    }
+    void unlock();
+};
+
+// cycle_stats
+//    Minimum and mean of repeated `rdtsc()` cycle counts, for benchmarks.
+struct cycle_stats {
+    uint64_t min_ = ~0UL;
+    uint64_t total_ = 0;
+    unsigned n_ = 0;
+
+    void add(uint64_t cycles) {
+        min_ = cycles < min_ ? cycles : min_;
+        total_ += cycles;
+        ++n_;
+    }
+    uint64_t mean() const {
+        return n_ ? total_ / n_ : 0;
+    }
+};
+
 // app_printf(format, ...)
 //    Calls console_printf() (see lib.h). The cursor position is read from
 //    `cursorpos`, a shared variable defined by the kernel, and written back
@@ -0,0 +1,185 @@
+#include "p-lib.hh"
+
+// p-testfpu
+//
+//    Checks that the kernel keeps each process's SSE state: all sixteen
+//    %xmm registers and %mxcsr. Processes are built with `-mno-sse`, so
+//    the SSE code here is in `target("sse2")` functions. Each check loads
+//    distinct per-process values, makes a system call from the same
+//    `asm` block, and compares what the registers hold afterwards. With
+//    several processes on each CPU, `sys_yield` switches between FPU
+//    users, exercising the kernel's lazy save and restore; `sys_fork`
+//    must give the child a copy of the parent's state.
+
+#define NWORKERS        4       // processes in the yield test
+#define ROUNDS          200
+
+struct fpu_regs {
+    uint64_t xmm[16][2];
+    uint32_t mxcsr;
+};
+
+
+// fpu_syscall(nr, in, out)
+//    Load `in` into the SSE registers, run system call `nr` (with no
+//    arguments), store the registers to `out`, and return the result.
+
+__attribute__((target("sse2")))
+static uintptr_t fpu_syscall(int nr, const fpu_regs* in, fpu_regs* out) {
+    register uintptr_t rax asm("rax") = nr;
+    asm volatile ("ldmxcsr %c[mx](%[in])\n\t"
+                  "movdqu 0(%[in]), %%xmm0\n\t"
+                  "movdqu 16(%[in]), %%xmm1\n\t"
+                  "movdqu 32(%[in]), %%xmm2\n\t"
+                  "movdqu 48(%[in]), %%xmm3\n\t"
+                  "movdqu 64(%[in]), %%xmm4\n\t"
+                  "movdqu 80(%[in]), %%xmm5\n\t"
+                  "movdqu 96(%[in]), %%xmm6\n\t"
+                  "movdqu 112(%[in]), %%xmm7\n\t"
+                  "movdqu 128(%[in]), %%xmm8\n\t"
+                  "movdqu 144(%[in]), %%xmm9\n\t"
+                  "movdqu 160(%[in]), %%xmm10\n\t"
+                  "movdqu 176(%[in]), %%xmm11\n\t"
+                  "movdqu 192(%[in]), %%xmm12\n\t"
+                  "movdqu 208(%[in]), %%xmm13\n\t"
+                  "movdqu 224(%[in]), %%xmm14\n\t"
+                  "movdqu 240(%[in]), %%xmm15\n\t"
+                  "syscall\n\t"
+                  "movdqu %%xmm0, 0(%[out])\n\t"
+                  "movdqu %%xmm1, 16(%[out])\n\t"
+                  "movdqu %%xmm2, 32(%[out])\n\t"
+                  "movdqu %%xmm3, 48(%[out])\n\t"
+                  "movdqu %%xmm4, 64(%[out])\n\t"
+                  "movdqu %%xmm5, 80(%[out])\n\t"
+                  "movdqu %%xmm6, 96(%[out])\n\t"
+                  "movdqu %%xmm7, 112(%[out])\n\t"
+                  "movdqu %%xmm8, 128(%[out])\n\t"
+                  "movdqu %%xmm9, 144(%[out])\n\t"
+                  "movdqu %%xmm10, 160(%[out])\n\t"
+                  "movdqu %%xmm11, 176(%[out])\n\t"
+                  "movdqu %%xmm12, 192(%[out])\n\t"
+                  "movdqu %%xmm13, 208(%[out])\n\t"
+                  "movdqu %%xmm14, 224(%[out])\n\t"
+                  "movdqu %%xmm15, 240(%[out])\n\t"
+                  "stmxcsr %c[mx](%[out])"
+                  : "+a" (rax)
+                  : [in] "r" (in), [out] "r" (out),
+                    [mx] "i" (offsetof(fpu_regs, mxcsr))
+                  : "cc", "memory", "rcx", "rdx", "rsi", "rdi",
+                    "r8", "r9", "r10", "r11",
+                    "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+                    "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11",
+                    "xmm12", "xmm13", "xmm14", "xmm15");
+    return rax;
+}
+
+
+// simd_sum(a, n)
+//    Return the sum of `a[0..n)`, `n` a multiple of 4, computed with
+//    packed 32-bit adds.
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+__attribute__((target("sse2")))
+static uint32_t simd_sum(const uint32_t* a, size_t n) {
+    v4u32 acc = {0, 0, 0, 0};
+    for (size_t i = 0; i != n; i += 4) {
+        v4u32 v;
+        __builtin_memcpy(&v, &a[i], sizeof(v));
+        acc += v;
+    }
+    return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+
+// fill(r, seed, round)
+//    Fill `r` with values unique to `seed` and `round`. The %mxcsr value
+//    keeps every exception masked but varies the rounding mode and
+//    flush-to-zero bits.
+
+static void fill(fpu_regs* r, uint64_t seed, uint64_t round) {
+    for (int i = 0; i != 16; ++i) {
+        r->xmm[i][0] = seed * 0x9E3779B97F4A7C15UL + i;
+        r->xmm[i][1] = (round << 32) ^ (seed << 8) ^ i;
+    }
+    r->mxcsr = 0x1F80 | ((seed & 3) << 13) | ((round & 1) << 15);
+}
+
+static bool same(const fpu_regs* a, const fpu_regs* b) {
+    return memcmp(a->xmm, b->xmm, sizeof(a->xmm)) == 0
+        && a->mxcsr == b->mxcsr;
+}
+
+
+// check_fork()
+//    Check that a forked child starts with its parent's SSE state, and
+//    that the parent keeps it.
+
+static bool check_fork() {
+    fpu_regs in, out;
+    fill(&in, 0xF0F0, 1);
+    pid_t p = fpu_syscall(SYSCALL_FORK, &in, &out);
+    if (p == 0) {
+        sys_exit(same(&in, &out) ? 0 : 1);
+    }
+    assert(p > 0);
+    int status;
+    pid_t w = sys_waitpid(p, &status);
+    assert(w == p);
+    return same(&in, &out) && status == 0;
+}
+
+
+// check_yield(seed)
+//    Check that SSE state survives `sys_yield` while other processes
+//    use different values.
+
+static bool check_yield(uint64_t seed) {
+    for (uint64_t round = 0; round != ROUNDS; ++round) {
+        fpu_regs in, out;
+        fill(&in, seed, round);
+        fpu_syscall(SYSCALL_YIELD, &in, &out);
+        if (!same(&in, &out)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void process_main(void) {
+    uint32_t a[64];
+    uint32_t expected = 0;
+    for (uint32_t i = 0; i != arraysize(a); ++i) {
+        a[i] = i * 2654435761U;
+        expected += a[i];
+    }
+    bool ok = simd_sum(a, arraysize(a)) == expected;
+    app_printf(0, "simd_sum: %s\n", ok ? "ok" : "FAIL");
+
+    bool fork_ok = check_fork();
+    app_printf(0, "fork: %s\n", fork_ok ? "ok" : "FAIL");
+    ok = ok && fork_ok;
+
+    // processes stay on CPU `pid % ncpu`, so the workers share CPUs
+    pid_t workers[NWORKERS - 1];
+    for (int i = 0; i != NWORKERS - 1; ++i) {
+        workers[i] = sys_fork();
+        assert(workers[i] >= 0);
+        if (workers[i] == 0) {
+            sys_exit(check_yield(sys_getpid()) ? 0 : 1);
+        }
+    }
+    bool yield_ok = check_yield(sys_getpid());
+    for (int i = 0; i != NWORKERS - 1; ++i) {
+        int status;
+        pid_t w = sys_waitpid(workers[i], &status);
+        assert(w == workers[i]);
+        yield_ok = yield_ok && status == 0;
+    }
+    app_printf(0, "yield, %d processes: %s\n", NWORKERS,
+               yield_ok ? "ok" : "FAIL");
+    ok = ok && yield_ok;
+
+    app_printf(0, ok ? "testfpu: all passed\n" : "testfpu: FAILED\n");
+    sys_exit(0);
+}
@@ -26,6 +26,7 @@
 #define PTE_D           0x40UL   // entry was Dirtied (written)
 // Other special-purpose flags
 #define PTE_PS          0x80UL   // entry has a large Page Size
+#define PTE_G           0x100UL  // entry is Global (kept across %cr3 loads)
 #define PTE_PWT         0x8UL
 #define PTE_PCD         0x10UL
 #define PTE_XD          0x8000000000000000UL // entry is eXecute Disabled
@@ -202,6 +203,20 @@ DECLARE_X86_FUNCTION(void     wrmsr(uint32_t msr, uint64_t v));
 // %cr4 flag bits
 #define CR4_PSE                 0x00000010      // Page Size Extensions
 #define CR4_PAE                 0x00000020      // Physical Address Extensions
+#define CR4_PGE                 0x00000080      // Page Global Enable
+#define CR4_OSFXSR              0x00000200      // FXSAVE/FXRSTOR and SSE
+#define CR4_OSXMMEXCPT          0x00000400      // Unmasked SSE Exceptions
+#define CR4_PCIDE               0x00020000      // Process-Context IDs Enable
+#define CR4_OSXSAVE             0x00040000      // XSAVE and %xcr0
+
+// %xcr0 state component bits (with CR4_OSXSAVE)
+#define XCR0_X87                0x1             // x87 FPU
+#define XCR0_SSE                0x2             // %xmm registers, %mxcsr
+#define XCR0_AVX                0x4             // upper halves of %ymm
+
+// %cr3 flag bits (with CR4_PCIDE)
+#define CR3_PCIDMASK            0xFFFUL         // process-context ID
+#define CR3_NOFLUSH             0x8000000000000000UL // keep PCID's TLB entries
 
 // eflags bits (useful for read_eflags() and write_eflags())
 #define EFLAGS_CF               0x00000001      // Carry Flag
@@ -346,13 +361,17 @@ static inline uintptr_t rcr3() {
     return val;
 }
 
+static inline void clts() {
+    asm volatile("clts" : : : "memory");
+}
+
 static inline void lcr4(uint64_t val) {
     asm volatile("movq %0,%%cr4" : : "r" (val));
 }
 
 static inline uint64_t rcr4() {
     uint64_t cr4;
-    asm volatile("movl %%cr4,%0" : "=r" (cr4));
+    asm volatile("movq %%cr4,%0" : "=r" (cr4));
     return cr4;
 }
 
@@ -369,9 +388,19 @@ static inline bool is_cli() {
 }
 
 static inline void tlbflush() {
-    uint32_t cr3;
-    asm volatile("movl %%cr3,%0" : "=r" (cr3));
-    asm volatile("movl %0,%%cr3" : : "r" (cr3));
+    uintptr_t cr3;
+    asm volatile("movq %%cr3,%0" : "=r" (cr3));
+    asm volatile("movq %0,%%cr3" : : "r" (cr3) : "memory");
+}
+
+// tlbflush_all()
+//    Flush the whole TLB, including global entries and entries for
+//    every PCID, by toggling CR4_PGE. Use after changing kernel mappings.
+static inline void tlbflush_all() {
+    uint64_t cr4;
+    asm volatile("movq %%cr4,%0" : "=r" (cr4));
+    asm volatile("movq %0,%%cr4" : : "r" (cr4 ^ CR4_PGE) : "memory");
+    asm volatile("movq %0,%%cr4" : : "r" (cr4) : "memory");
 }
 
 static inline uint32_t read_eflags() {
@@ -406,6 +435,20 @@ static inline struct x86_64_cpuid_t cpuid(uint32_t info) {
     return ret;
 }
 
+static inline struct x86_64_cpuid_t cpuid(uint32_t info, uint32_t subinfo) {
+    x86_64_cpuid_t ret;
+    asm volatile("cpuid"
+                 : "=a" (ret.eax), "=b" (ret.ebx),
+                   "=c" (ret.ecx), "=d" (ret.edx)
+                 : "a" (info), "c" (subinfo));
+    return ret;
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t val) {
+    asm volatile("xsetbv" : : "c" (reg), "a" ((uint32_t) val),
+                 "d" ((uint32_t) (val >> 32)));
+}
+
 static inline uint64_t rdmsr(uint32_t msr) {
     uint64_t low, high;
     asm volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));